@@ -1,8 +1,11 @@
 #ifndef AST_H
 #define AST_H
 
-#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/ArrayRef.h"
 #include "llvm/ADT/StringRef.h"
+#include "llvm/Support/TrailingObjects.h"
+#include <cassert>
+#include <memory>
 
 // Forward declarations of classes used in the AST
 class AST; //h
@@ -26,48 +29,95 @@ public:
   virtual void visit(AST &) {}               // Visit the base AST node
   virtual void visit(Expr &) {}              // Visit the expression node
   virtual void visit(GSM &) = 0;             // Visit the group of expressions node
-  virtual void visit(Factor &) = 0;          // Visit the factor node
   virtual void visit(BinaryOp &) = 0;        // Visit the binary operation node
   virtual void visit(Equation &) = 0;      // Visit the assignment expression node
   virtual void visit(Declaration &) = 0;     // Visit the variable declaration node
   virtual void visit(Final &) = 0;
+  virtual void visit(Conditions &) = 0;
   virtual void visit(Condition &) = 0;
   virtual void visit(If &) = 0;
   virtual void visit(Elif &) = 0;
   virtual void visit(Else &) = 0;
+  virtual void visit(Loop &) = 0;
 };
 
 // AST class serves as the base class for all AST nodes
 class AST
 {
 public:
+  // Kind of the node, lets passes dispatch with a switch instead of a
+  // virtual call (see ASTWalker.h) and supports isa<>/dyn_cast<>
+  enum NodeKind : unsigned char
+  {
+    NK_GSM,
+    NK_Final,
+    NK_BinaryOp,
+    NK_Equation,
+    NK_Declaration,
+    NK_Conditions,
+    NK_Condition,
+    NK_If,
+    NK_Elif,
+    NK_Else,
+    NK_Loop
+  };
+
+private:
+  const NodeKind Kind;
+
+public:
+  AST(NodeKind Kind) : Kind(Kind) {}
   virtual ~AST() {}
+  NodeKind getNodeKind() const { return Kind; }
   virtual void accept(ASTVisitor &V) = 0;    // Accept a visitor for traversal
 };
 
 // Expr class represents an expression in the AST
 class Expr : public AST
 {
+  bool Shared = false;  // Has more than one parent, see ASTContext::getBinaryOp
+
 public:
-  Expr() {}
+  Expr(NodeKind Kind) : AST(Kind) {}
+
+  // A shared expression is reached from several places in the tree, which
+  // may reuse its value if nothing it reads was assigned in between
+  bool isShared() const { return Shared; }
+  void markShared() { Shared = true; }
 };
 
 // GSM class represents a group of expressions in the AST
-class GSM : public Expr
+// Nodes with a list of children keep it right behind the node, in the same
+// arena allocation (see ASTContext::create), sized exactly; the accessors
+// hand out ArrayRefs to it.
+class GSM final : public Expr, private llvm::TrailingObjects<GSM, Expr *>
 {
-  using ExprVector = llvm::SmallVector<Expr *>;
+  friend TrailingObjects;
 
-private:
-  ExprVector exprs;                          // Stores the list of expressions
+  unsigned NumExprs;                         // Number of expressions
 
 public:
-  GSM(llvm::SmallVector<Expr *> exprs) : exprs(exprs) {}
+  GSM(llvm::ArrayRef<Expr *> exprs) : Expr(NK_GSM), NumExprs(exprs.size())
+  {
+    std::uninitialized_copy(exprs.begin(), exprs.end(), getTrailingObjects<Expr *>());
+  }
 
-  llvm::SmallVector<Expr *> getExprs() { return exprs; }
+  // Bytes to allocate for a GSM with these expressions
+  static size_t allocSize(llvm::ArrayRef<Expr *> exprs)
+  {
+    return totalSizeToAlloc<Expr *>(exprs.size());
+  }
 
-  ExprVector::const_iterator begin() { return exprs.begin(); }
+  llvm::ArrayRef<Expr *> getExprs() const
+  {
+    return llvm::makeArrayRef(getTrailingObjects<Expr *>(), NumExprs);
+  }
 
-  ExprVector::const_iterator end() { return exprs.end(); }
+  llvm::ArrayRef<Expr *>::iterator begin() const { return getExprs().begin(); }
+
+  llvm::ArrayRef<Expr *>::iterator end() const { return getExprs().end(); }
+
+  static bool classof(const AST *N) { return N->getNodeKind() == NK_GSM; }
 
   virtual void accept(ASTVisitor &V) override
   {
@@ -79,21 +129,35 @@ public:
 
 class Final  : public Expr{
   public:
-  enum ValueKind{
+  enum ValueKind : unsigned char{
     id,
     num
   };
   private:
    ValueKind Kind;
+   unsigned Sym;          // symbol ID of an identifier, see Interner.h
    llvm::StringRef Val;
 
-  ublic:
-  Final(ValueKind Kind, llvm::StringRef Val) : Kind(Kind), Val(Val) {}
+  public:
+  Final(ValueKind Kind, llvm::StringRef Val, unsigned Sym = 0)
+      : Expr(NK_Final), Kind(Kind), Sym(Sym), Val(Val) {}
 
   ValueKind getKind() { return Kind; }
 
   llvm::StringRef getVal() { return Val; }
 
+  // Where to report this use of the leaf, in the statement starting at
+  // Statement. A shared leaf has the text of its first occurrence, maybe
+  // in another statement, so it is reported at the statement instead.
+  const char *getLoc(const char *Statement) {
+    return isShared() ? Statement : Val.data();
+  }
+
+  // symbol ID of the identifier, only meaningful if getKind() is id
+  unsigned getSymbol() { return Sym; }
+
+  static bool classof(const AST *N) { return N->getNodeKind() == NK_Final; }
+
   virtual void accept(ASTVisitor &V) override
   {
     V.visit(*this);
@@ -125,19 +189,27 @@ public:
   };
 
 private:
+  Operator Op;                              // Operator of the binary operation
   Expr *Left;                               // Left-hand side expression
   Expr *Right;                              // Right-hand side expression
-  Operator Op;                              // Operator of the binary operation
 
 public:
-  BinaryOp(Operator Op, Expr *L, Expr *R) : Op(Op), Left(L), Right(R) {}
+  BinaryOp(Operator Op, Expr *L, Expr *R) : Expr(NK_BinaryOp), Op(Op), Left(L), Right(R) {}
 
   Expr *getLeft() { return Left; }
 
   Expr *getRight() { return Right; }
 
+  // Operands are replaced by passes that rewrite the tree, such as
+  // ConstFold; the operands of a shared node must stay as they are
+  void setLeft(Expr *L) { Left = L; }
+
+  void setRight(Expr *R) { Right = R; }
+
   Operator getOperator() { return Op; }
 
+  static bool classof(const AST *N) { return N->getNodeKind() == NK_BinaryOp; }
+
   virtual void accept(ASTVisitor &V) override
   {
     V.visit(*this);
@@ -150,14 +222,27 @@ class Equation : public Expr
 private:
   Final *Left;                             // Left-hand side factor (identifier)
   Expr *Right;                              // Right-hand side expression
+  bool DeadStore = false;                   // The value stored is never read
 
 public:
-  Equation(Final *L, Expr *R) : Left(L), Right(R) {}
+  Equation(Final *L, Expr *R) : Expr(NK_Equation), Left(L), Right(R) {}
 
   Final *getLeft() { return Left; }
 
   Expr *getRight() { return Right; }
 
+  // where the statement starts, its target, which is never shared
+  const char *getLoc() { return Left->getVal().data(); }
+
+  void setRight(Expr *R) { Right = R; }
+
+  // A dead store is still printed, but nothing reads the variable before it
+  // is assigned again, see DefUse
+  bool isDeadStore() const { return DeadStore; }
+  void setDeadStore(bool Dead) { DeadStore = Dead; }
+
+  static bool classof(const AST *N) { return N->getNodeKind() == NK_Equation; }
+
   virtual void accept(ASTVisitor &V) override
   {
     V.visit(*this);
@@ -165,21 +250,86 @@ public:
 };
 
 // Declaration class represents a variable declaration with an initializer in the AST
-class Declaration : public Expr
+class Declaration final : public Expr,
+                          private llvm::TrailingObjects<Declaration, llvm::StringRef,
+                                                        unsigned, unsigned char>
 {
-  using VarVector = llvm::SmallVector<llvm::StringRef, 8>;
-  VarVector Vars;                           // Stores the list of variables
+public:
+  // What DefUse found out about the reads of a declared variable
+  enum VarUse : unsigned char
+  {
+    UseRead,     // Read, maybe its initial value; the default
+    UseDeadInit, // Read, but never its initial value
+    UseNone      // Never read, it needs no storage
+  };
+
+private:
+  friend TrailingObjects;
+
+  unsigned NumVars;                         // Number of declared variables
   Expr *E;                                  // Expression serving as the initializer
 
+  size_t numTrailingObjects(OverloadToken<llvm::StringRef>) const { return NumVars; }
+  size_t numTrailingObjects(OverloadToken<unsigned>) const { return NumVars; }
+
 public:
-  Declaration(llvm::SmallVector<llvm::StringRef, 8> Vars, Expr *E) : Vars(Vars), E(E) {}
+  // Syms holds the symbol ID of each of Vars
+  Declaration(llvm::ArrayRef<llvm::StringRef> Vars,
+              llvm::ArrayRef<unsigned> Syms, Expr *E)
+      : Expr(NK_Declaration), NumVars(Vars.size()), E(E)
+  {
+    assert(Vars.size() == Syms.size() && "every variable needs a symbol");
+    std::uninitialized_copy(Vars.begin(), Vars.end(),
+                            getTrailingObjects<llvm::StringRef>());
+    std::uninitialized_copy(Syms.begin(), Syms.end(),
+                            getTrailingObjects<unsigned>());
+    std::uninitialized_fill_n(getTrailingObjects<unsigned char>(), NumVars,
+                              UseRead);
+  }
 
-  VarVector::const_iterator begin() { return Vars.begin(); }
+  static size_t allocSize(llvm::ArrayRef<llvm::StringRef> Vars,
+                          llvm::ArrayRef<unsigned>, Expr *)
+  {
+    return totalSizeToAlloc<llvm::StringRef, unsigned, unsigned char>(
+        Vars.size(), Vars.size(), Vars.size());
+  }
 
-  VarVector::const_iterator end() { return Vars.end(); }
+  llvm::ArrayRef<llvm::StringRef> getVars() const
+  {
+    return llvm::makeArrayRef(getTrailingObjects<llvm::StringRef>(), NumVars);
+  }
+
+  // symbol IDs of the variables, in the order of getVars()
+  llvm::ArrayRef<unsigned> getSymbols() const
+  {
+    return llvm::makeArrayRef(getTrailingObjects<unsigned>(), NumVars);
+  }
+
+  VarUse getVarUse(unsigned I) const
+  {
+    assert(I < NumVars && "variable index out of range");
+    return VarUse(getTrailingObjects<unsigned char>()[I]);
+  }
+
+  void setVarUse(unsigned I, VarUse Use)
+  {
+    assert(I < NumVars && "variable index out of range");
+    getTrailingObjects<unsigned char>()[I] = Use;
+  }
+
+  llvm::ArrayRef<llvm::StringRef>::iterator begin() const { return getVars().begin(); }
+
+  llvm::ArrayRef<llvm::StringRef>::iterator end() const { return getVars().end(); }
 
   Expr *getExpr() { return E; }
 
+  void setExpr(Expr *Init) { E = Init; }
+
+  // the first declared name, for diagnostics about the statement
+  const char *getLoc() const { return getVars().front().data(); }
+
+  static bool classof(const AST *N) { return N->getNodeKind() == NK_Declaration; }
+
   virtual void accept(ASTVisitor &V) override
   {
     V.visit(*this);
@@ -190,26 +340,40 @@ public:
 
 
 
+// Conditions class represents conditions joined with and/or in the AST
 class Conditions : public Expr {
-  public enum andOr {
+  public:
+  enum andOr {
       KW_and,
       KW_or
   };
 
 
   private :
-    Condition *Left;
-    andOr *AO;
+    andOr AO;
+    Conditions *Left;
     Conditions *Right;
 
+  protected :
+    // used by Condition, a single comparison
+    Conditions(NodeKind Kind) : Expr(Kind), AO(KW_and), Left(nullptr), Right(nullptr) {}
+
   public :
-    Conditions(Condition *Left1 , andOr *AO1 , Conditions *Right1): Left(Left1) , AO(AO1) , Right(Right1) {}
+    Conditions(andOr AO1 , Conditions *Left1 , Conditions *Right1): Expr(NK_Conditions), AO(AO1) , Left(Left1) , Right(Right1) {}
     Conditions *getLeft() { return Left; }
-    Conditions *getAO() {return AO; }
+    andOr getAO() {return AO; }
     Conditions *getRight() {return Right; }
 
+    void setLeft(Conditions *L) { Left = L; }
+
+    void setRight(Conditions *R) { Right = R; }
+
 
-    virtual void accept(ASTVisitor &V) {
+    static bool classof(const AST *N) {
+      return N->getNodeKind() == NK_Conditions || N->getNodeKind() == NK_Condition;
+    }
+
+    virtual void accept(ASTVisitor &V) override {
       V.visit(*this);
     }
 
@@ -228,86 +392,175 @@ public:
   };
 
 private:
+  OperatorCondition Op;
   Expr *Left;  // Left-hand side expression
   Expr *Right; // Right-hand side expression
-  OperatorCondition Op;
 
 public:
-  Condition(OperatorCondition Op, Expr *L, Expr *R) : Op(Op), Left(L), Right(R) {}
+  Condition(OperatorCondition Op, Expr *L, Expr *R) : Conditions(NK_Condition), Op(Op), Left(L), Right(R) {}
 
   Expr *getLeft() { return Left; }
 
   Expr *getRight() { return Right; }
 
+  void setLeft(Expr *L) { Left = L; }
+
+  void setRight(Expr *R) { Right = R; }
+
   OperatorCondition getOperator() { return Op; }
 
+  static bool classof(const AST *N) { return N->getNodeKind() == NK_Condition; }
+
   virtual void accept(ASTVisitor &V) override {
     V.visit(*this);
   }
 };
 
-class If : public Expr {
-private:
-  Conditions *condition;
-  //llvm::SmallVector<Equation *> Conds;
-  llvm::SmallVector<Equation *> Equations;
-  llvm::SmallVector<Elif *> Elifs;
-  Else *Else;
+// If class represents an if statement with its elif and else branches; the
+// statements of the body and the elifs trail the node
+class If final : public Expr,
+                 private llvm::TrailingObjects<If, Expr *, Elif *> {
+  friend TrailingObjects;
+
+  unsigned NumStatements;
+  Conditions *Cond;
+  unsigned NumElifs;
+  Else *ElseBranch; // nullptr without an else
+  const char *Loc;  // the if keyword
+
+  size_t numTrailingObjects(OverloadToken<Expr *>) const { return NumStatements; }
 
 public:
-  If(Conditions *Conditions, llvm::SmallVector<Equation *> Equations, llvm::SmallVector<Elif *> Elifs, Else *Else) :
-    conditions(Conditions), Equations(Equations), Elifs(Elifs), Else(Else) {}
+  If(Conditions *Cond, llvm::ArrayRef<Expr *> Body,
+     llvm::ArrayRef<Elif *> Elifs, Else *ElseBranch, const char *Loc)
+      : Expr(NK_If), NumStatements(Body.size()), Cond(Cond),
+        NumElifs(Elifs.size()), ElseBranch(ElseBranch), Loc(Loc) {
+    std::uninitialized_copy(Body.begin(), Body.end(),
+                            getTrailingObjects<Expr *>());
+    std::uninitialized_copy(Elifs.begin(), Elifs.end(), getTrailingObjects<Elif *>());
+  }
 
-  Condition *getCondition() { return conditions; }
+  static size_t allocSize(Conditions *, llvm::ArrayRef<Expr *> Body,
+                          llvm::ArrayRef<Elif *> Elifs, Else *, const char *) {
+    return totalSizeToAlloc<Expr *, Elif *>(Body.size(), Elifs.size());
+  }
+
+  Conditions *getCondition() { return Cond; }
+
+  llvm::ArrayRef<Expr *> getBody() const {
+    return llvm::makeArrayRef(getTrailingObjects<Expr *>(), NumStatements);
+  }
+
+  llvm::ArrayRef<Elif *> getElifs() const {
+    return llvm::makeArrayRef(getTrailingObjects<Elif *>(), NumElifs);
+  }
+
+  Else *getElse() { return ElseBranch; }
 
-  llvm::SmallVector<Elif *> getElifs() { return Elifs; }
+  const char *getLoc() const { return Loc; }
 
-  Else *getElse() { return Else; }
+  static bool classof(const AST *N) { return N->getNodeKind() == NK_If; }
 
   virtual void accept(ASTVisitor &V) override {
     V.visit(*this);
   }
-
 };
 
+class Elif final : public Expr, private llvm::TrailingObjects<Elif, Expr *> {
+  friend TrailingObjects;
+
+  unsigned NumStatements;
+  Conditions *Cond;
+  const char *Loc; // the elif keyword
 
-class Elif : public Expr {
-  private : 
-  Conditions *condition;
-  llvm::SmallVector<Equation *> Equations;
-  //llvm::SmallVector<Elif *> Elifs;
-  //Else *Else;
   public :
-  Elif(Conditions *cnd , llvm::SmallVector<Equation > *Equ ) : condition(cnd) , Equations(Equ){}
-  Condition *getCondition() {return condition; }
-  llvm::SmallVector<Equation *> EquationsGet() {return Equations;}
+  Elif(Conditions *Cond, llvm::ArrayRef<Expr *> Body, const char *Loc)
+      : Expr(NK_Elif), NumStatements(Body.size()), Cond(Cond), Loc(Loc) {
+    std::uninitialized_copy(Body.begin(), Body.end(),
+                            getTrailingObjects<Expr *>());
+  }
 
+  static size_t allocSize(Conditions *, llvm::ArrayRef<Expr *> Body,
+                          const char *) {
+    return totalSizeToAlloc<Expr *>(Body.size());
+  }
 
-}
+  Conditions *getCondition() { return Cond; }
 
+  llvm::ArrayRef<Expr *> getBody() const {
+    return llvm::makeArrayRef(getTrailingObjects<Expr *>(), NumStatements);
+  }
 
+  const char *getLoc() const { return Loc; }
+
+  static bool classof(const AST *N) { return N->getNodeKind() == NK_Elif; }
+
+  virtual void accept(ASTVisitor &V) override {
+    V.visit(*this);
+  }
+};
+
+class Else final : public Expr, private llvm::TrailingObjects<Else, Expr *> {
+  friend TrailingObjects;
+
+  unsigned NumStatements;
 
-class Else : public Expr {
-  private :
-  Conditions *condition;
-  llvm::SmallVector<Equation *> Equations;
   public :
-  Else(Conditions *cnd , llvm::SmallVector<Equation > *Equ ) : condition(cnd) , Equations(Equ){}
-  Condition *getCondition() {return condition; }
-  llvm::SmallVector<Equation *> EquationsGet() {return Equations;}
+  Else(llvm::ArrayRef<Expr *> Body)
+      : Expr(NK_Else), NumStatements(Body.size()) {
+    std::uninitialized_copy(Body.begin(), Body.end(),
+                            getTrailingObjects<Expr *>());
+  }
 
+  static size_t allocSize(llvm::ArrayRef<Expr *> Body) {
+    return totalSizeToAlloc<Expr *>(Body.size());
+  }
+
+  llvm::ArrayRef<Expr *> getBody() const {
+    return llvm::makeArrayRef(getTrailingObjects<Expr *>(), NumStatements);
+  }
 
-}
+  static bool classof(const AST *N) { return N->getNodeKind() == NK_Else; }
 
-class Loop : public Expr{
-  private: 
+  virtual void accept(ASTVisitor &V) override {
+    V.visit(*this);
+  }
+};
 
-  Conditions *condition;
-  llvm::SmallVector<Equation *> Equations;
+// Loop class represents a loopc statement, its body runs while the
+// conditions hold
+class Loop final : public Expr, private llvm::TrailingObjects<Loop, Expr *> {
+  friend TrailingObjects;
 
-  public: 
-  Loop(Conditions *con , llvm::SmallVector<Equation > *Equ) : condition(con), Equation(Equ){}
-}
+  unsigned NumStatements;
+  Conditions *Cond;
+  const char *Loc; // the loopc keyword
 
+  public:
+  Loop(Conditions *Cond, llvm::ArrayRef<Expr *> Body, const char *Loc)
+      : Expr(NK_Loop), NumStatements(Body.size()), Cond(Cond), Loc(Loc) {
+    std::uninitialized_copy(Body.begin(), Body.end(),
+                            getTrailingObjects<Expr *>());
+  }
+
+  static size_t allocSize(Conditions *, llvm::ArrayRef<Expr *> Body,
+                          const char *) {
+    return totalSizeToAlloc<Expr *>(Body.size());
+  }
+
+  Conditions *getCondition() { return Cond; }
+
+  llvm::ArrayRef<Expr *> getBody() const {
+    return llvm::makeArrayRef(getTrailingObjects<Expr *>(), NumStatements);
+  }
+
+  const char *getLoc() const { return Loc; }
+
+  static bool classof(const AST *N) { return N->getNodeKind() == NK_Loop; }
+
+  virtual void accept(ASTVisitor &V) override {
+    V.visit(*this);
+  }
+};
 
 #endif
@@ -0,0 +1,274 @@
+#ifndef ASTCONTEXT_H
+#define ASTCONTEXT_H
+
+#include "AST.h"
+#include "Interner.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Support/Casting.h"
+#include "llvm/Support/Allocator.h"
+#include <algorithm>
+#include <cassert>
+#include <memory>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+// ASTContext owns the nodes of one compilation unit. They are carved out of
+// a single bump allocator, so building the tree costs no malloc per node,
+// nodes built together sit together in memory, and the whole tree is freed
+// at once when the context goes away. Child lists live in the allocation
+// of their node, so nodes own no other memory and their destructors are
+// never run.
+//
+// With hash-consing enabled, getFinal() and getBinaryOp() hand out one node
+// for all structurally equal expressions, so repeated subexpressions form a
+// DAG and are stored once. Expressions cannot have side effects, but they
+// read variables, so whoever reuses the value of a shared node must check
+// that none of them was assigned since.
+class ASTContext
+{
+    llvm::BumpPtrAllocator Alloc; // storage of all nodes
+    size_t NumNodes = 0;          // nodes created
+    std::vector<std::unique_ptr<ASTContext>> SubContexts;
+    Interner OwnSymbols;          // unused by sub-contexts
+    Interner &Symbols;            // identifiers of the tree
+    bool IsSubContext = false;    // only looks up Symbols
+
+    // unique expressions, children of a BinaryOp are unique already
+    bool HashConsing = false;
+    llvm::DenseMap<unsigned, Final *> UniqueIds;
+    llvm::DenseMap<llvm::StringRef, Final *> UniqueNums;
+    llvm::DenseMap<std::tuple<unsigned, Expr *, Expr *>, BinaryOp *>
+        UniqueBinaryOps;
+
+    template <typename T> static T *share(T *Node)
+    {
+        Node->markShared();
+        return Node;
+    }
+
+    // a sub-context looks names up in the symbols of its parent
+    ASTContext(Interner &Symbols) : Symbols(Symbols), IsSubContext(true) {}
+
+    // nodes with trailing child lists report their size through a static
+    // allocSize() taking the constructor arguments
+    template <typename T, typename... ArgTys>
+    static auto getAllocSize(int, const ArgTys &...Args)
+        -> decltype(T::allocSize(Args...))
+    {
+        return T::allocSize(Args...);
+    }
+
+    template <typename T, typename... ArgTys>
+    static size_t getAllocSize(long, const ArgTys &...)
+    {
+        return sizeof(T);
+    }
+
+public:
+    ASTContext() : Symbols(OwnSymbols) {}
+    ASTContext(const ASTContext &) = delete;
+    ASTContext &operator=(const ASTContext &) = delete;
+    ~ASTContext() { release(); }
+
+    // allocates and constructs a node in the arena
+    template <typename T, typename... ArgTys>
+    T *create(ArgTys &&...Args)
+    {
+        void *Mem = Alloc.Allocate(getAllocSize<T>(0, Args...), alignof(T));
+        ++NumNodes;
+        return new (Mem) T(std::forward<ArgTys>(Args)...);
+    }
+
+    // a separate arena that lives and dies with this one, for building
+    // parts of the tree on another thread; the names it meets must have
+    // been interned here before, and its hash-consing only shares within
+    // it until its expressions are passed to unify()
+    ASTContext &createSubContext()
+    {
+        SubContexts.emplace_back(new ASTContext(Symbols));
+        SubContexts.back()->HashConsing = HashConsing;
+        return *SubContexts.back();
+    }
+
+    // shares structurally equal expressions created from now on, in this
+    // context and sub-contexts created later
+    void setHashConsing(bool Enable) { HashConsing = Enable; }
+
+    bool isHashConsing() const { return HashConsing; }
+
+    // a Final, the existing one for the same identifier or literal if
+    // hash-consing
+    Final *getFinal(Final::ValueKind Kind, llvm::StringRef Val, unsigned Sym = 0)
+    {
+        if (!HashConsing)
+            return create<Final>(Kind, Val, Sym);
+        Final *&Slot = Kind == Final::id ? UniqueIds[Sym] : UniqueNums[Val];
+        if (Slot)
+            return share(Slot);
+        return Slot = create<Final>(Kind, Val, Sym);
+    }
+
+    // a BinaryOp, the existing one over the same operands if hash-consing
+    BinaryOp *getBinaryOp(BinaryOp::Operator Op, Expr *Left, Expr *Right)
+    {
+        if (!HashConsing)
+            return create<BinaryOp>(Op, Left, Right);
+        BinaryOp *&Slot = UniqueBinaryOps[std::make_tuple(Op, Left, Right)];
+        if (Slot)
+            return share(Slot);
+        return Slot = create<BinaryOp>(Op, Left, Right);
+    }
+
+    // the expression of this context that stands for E, an expression
+    // built in a sub-context: E with its operands unified, or the
+    // structurally equal one met here before, which is then shared.
+    // Comparisons are not shared, only their operands are unified. Every
+    // node unified is recorded in Unified, so that a subtree shared within
+    // the sub-context is only walked once, and operands are unified before
+    // their node without recursion.
+    Expr *unify(Expr *E, llvm::DenseMap<Expr *, Expr *> &Unified)
+    {
+        assert(HashConsing && "unifying without hash-consing");
+        llvm::SmallVector<Expr *, 32> Work{E};
+        while (!Work.empty())
+        {
+            Expr *Node = Work.back();
+            if (Unified.count(Node))
+            {
+                Work.pop_back();
+                continue;
+            }
+
+            Expr *Left = nullptr, *Right = nullptr;
+            if (auto *B = llvm::dyn_cast<BinaryOp>(Node))
+            {
+                Left = B->getLeft();
+                Right = B->getRight();
+            }
+            else if (auto *C = llvm::dyn_cast<Condition>(Node))
+            {
+                Left = C->getLeft();
+                Right = C->getRight();
+            }
+            else if (auto *C = llvm::dyn_cast<Conditions>(Node))
+            {
+                Left = C->getLeft();
+                Right = C->getRight();
+            }
+            if (Left)
+            {
+                auto UniqueLeft = Unified.find(Left);
+                auto UniqueRight = Unified.find(Right);
+                if (UniqueLeft == Unified.end() || UniqueRight == Unified.end())
+                {
+                    // the operands first, Node is met again after them
+                    Work.push_back(Right);
+                    Work.push_back(Left);
+                    continue;
+                }
+                Left = UniqueLeft->second;
+                Right = UniqueRight->second;
+            }
+
+            Expr *Unique = Node;
+            if (auto *F = llvm::dyn_cast<Final>(Node))
+            {
+                Final *&Slot = F->getKind() == Final::id
+                                   ? UniqueIds[F->getSymbol()]
+                                   : UniqueNums[F->getVal()];
+                if (!Slot)
+                    Slot = F;
+                else
+                    Unique = share(Slot);
+            }
+            else if (auto *B = llvm::dyn_cast<BinaryOp>(Node))
+            {
+                B->setLeft(Left);
+                B->setRight(Right);
+                BinaryOp *&Slot = UniqueBinaryOps[std::make_tuple(
+                    B->getOperator(), Left, Right)];
+                if (!Slot)
+                    Slot = B;
+                else
+                    Unique = share(Slot);
+            }
+            else if (auto *C = llvm::dyn_cast<Condition>(Node))
+            {
+                C->setLeft(Left);
+                C->setRight(Right);
+            }
+            else if (auto *C = llvm::dyn_cast<Conditions>(Node))
+            {
+                C->setLeft(static_cast<Conditions *>(Left));
+                C->setRight(static_cast<Conditions *>(Right));
+            }
+            Unified[Node] = Unique;
+            Work.pop_back();
+        }
+        return Unified[E];
+    }
+
+    // a copy of Text in the arena, for text of nodes that is not in the
+    // source
+    llvm::StringRef save(llvm::StringRef Text)
+    {
+        char *Mem = Alloc.Allocate<char>(Text.size());
+        std::copy(Text.begin(), Text.end(), Mem);
+        return llvm::StringRef(Mem, Text.size());
+    }
+
+    // symbol ID of the identifier Name; a sub-context, which may be used
+    // on another thread, only looks it up
+    unsigned intern(llvm::StringRef Name)
+    {
+        return IsSubContext ? Symbols.lookup(Name) : Symbols.intern(Name);
+    }
+
+    // the identifiers of the tree, shared with the sub-contexts
+    Interner &getSymbols() { return Symbols; }
+
+    // frees the sub-contexts and all nodes in them
+    void releaseSubContexts() { SubContexts.clear(); }
+
+    // frees all nodes in one go
+    void release()
+    {
+        SubContexts.clear();
+        UniqueIds.clear();
+        UniqueNums.clear();
+        UniqueBinaryOps.clear();
+        NumNodes = 0;
+        Alloc.Reset();
+    }
+
+    // number of nodes created
+    size_t getNumNodes() const
+    {
+        size_t Num = NumNodes;
+        for (const auto &Sub : SubContexts)
+            Num += Sub->getNumNodes();
+        return Num;
+    }
+
+    // bytes handed out to nodes
+    size_t getBytesUsed() const
+    {
+        size_t Bytes = Alloc.getBytesAllocated();
+        for (const auto &Sub : SubContexts)
+            Bytes += Sub->getBytesUsed();
+        return Bytes;
+    }
+
+    // bytes reserved by the arena, including unused slab space
+    size_t getBytesReserved() const
+    {
+        size_t Bytes = Alloc.getTotalMemory();
+        for (const auto &Sub : SubContexts)
+            Bytes += Sub->getBytesReserved();
+        return Bytes;
+    }
+};
+
+#endif
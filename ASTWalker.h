@@ -0,0 +1,208 @@
+#ifndef ASTWALKER_H
+#define ASTWALKER_H
+
+#include "AST.h"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Support/Compiler.h"
+#include "llvm/Support/ErrorHandling.h"
+#include <type_traits>
+
+// RecursiveASTWalker walks a tree with static dispatch: walk() switches on
+// the node kind and calls the walkX function of the pass Derived, so the
+// compiler sees every call and can inline them, where ASTVisitor costs two
+// virtual calls per node.
+//
+// A pass derives from RecursiveASTWalker<Derived> and hides only what it
+// needs:
+//   - visitX(X &) is called on every X before its children are walked,
+//     the default does nothing;
+//   - walkX(X &) calls visitX and then walks the children in source
+//     order; a pass hides it to control the order or skip children;
+//   - walkBody walks the statements of an if, elif, else or loopc body, a
+//     pass hides it to act on entering and leaving a scope.
+// The walkX functions that recurse are kept out of line, so the recursion
+// goes through one small function per kind.
+// Operators and comparisons nest as deep as the parser accepts, so their
+// walks do not recurse: walkExpr() walks such a subtree in pre-order on an
+// explicit stack and only calls back into the pass for the nodes whose
+// walkX it hides, which then recurse as deep as that walkX does.
+template <typename Derived>
+class RecursiveASTWalker
+{
+  Derived &getDerived() { return *static_cast<Derived *>(this); }
+
+  template <typename T>
+  void walkAll(llvm::ArrayRef<T *> Nodes)
+  {
+    for (T *Node : Nodes)
+      walk(Node);
+  }
+
+  // true if Derived walks a kind with the walkX of this class, i.e. if
+  // DerivedFn is the pointer to the walkX inherited from here
+  template <typename DerivedFn, typename BaseFn>
+  static constexpr bool isInherited(DerivedFn, BaseFn)
+  {
+    return std::is_same<DerivedFn, BaseFn>::value;
+  }
+
+  // walks the operators, comparisons and and/or of the subtree Root as the
+  // walkX of this class would, visiting a node before its operands
+  LLVM_ATTRIBUTE_NOINLINE void walkExpr(Expr *Root)
+  {
+    llvm::SmallVector<Expr *, 16> Work{Root};
+    while (!Work.empty())
+    {
+      Expr *Node = Work.pop_back_val();
+      switch (Node->getNodeKind())
+      {
+      case AST::NK_BinaryOp:
+        if (isInherited(&Derived::walkBinaryOp,
+                        &RecursiveASTWalker::walkBinaryOp))
+        {
+          auto *B = static_cast<BinaryOp *>(Node);
+          getDerived().visitBinaryOp(*B);
+          Work.push_back(B->getRight());
+          Work.push_back(B->getLeft());
+          continue;
+        }
+        break;
+      case AST::NK_Conditions:
+        if (isInherited(&Derived::walkConditions,
+                        &RecursiveASTWalker::walkConditions))
+        {
+          auto *C = static_cast<Conditions *>(Node);
+          getDerived().visitConditions(*C);
+          Work.push_back(C->getRight());
+          Work.push_back(C->getLeft());
+          continue;
+        }
+        break;
+      case AST::NK_Condition:
+        if (isInherited(&Derived::walkCondition,
+                        &RecursiveASTWalker::walkCondition))
+        {
+          auto *C = static_cast<Condition *>(Node);
+          getDerived().visitCondition(*C);
+          Work.push_back(C->getRight());
+          Work.push_back(C->getLeft());
+          continue;
+        }
+        break;
+      default:
+        break;
+      }
+      walk(Node);
+    }
+  }
+
+public:
+  // dispatches Node to the walkX function for its kind; inlined so that
+  // every call site gets its own switch, which the branch predictor learns
+  // separately, as it would the virtual calls of ASTVisitor
+  LLVM_ATTRIBUTE_ALWAYS_INLINE void walk(AST *Node)
+  {
+    switch (Node->getNodeKind())
+    {
+    case AST::NK_GSM:
+      return getDerived().walkGSM(*static_cast<GSM *>(Node));
+    case AST::NK_Final:
+      return getDerived().walkFinal(*static_cast<Final *>(Node));
+    case AST::NK_BinaryOp:
+      return getDerived().walkBinaryOp(*static_cast<BinaryOp *>(Node));
+    case AST::NK_Equation:
+      return getDerived().walkEquation(*static_cast<Equation *>(Node));
+    case AST::NK_Declaration:
+      return getDerived().walkDeclaration(*static_cast<Declaration *>(Node));
+    case AST::NK_Conditions:
+      return getDerived().walkConditions(*static_cast<Conditions *>(Node));
+    case AST::NK_Condition:
+      return getDerived().walkCondition(*static_cast<Condition *>(Node));
+    case AST::NK_If:
+      return getDerived().walkIf(*static_cast<If *>(Node));
+    case AST::NK_Elif:
+      return getDerived().walkElif(*static_cast<Elif *>(Node));
+    case AST::NK_Else:
+      return getDerived().walkElse(*static_cast<Else *>(Node));
+    case AST::NK_Loop:
+      return getDerived().walkLoop(*static_cast<Loop *>(Node));
+    }
+    llvm_unreachable("unknown AST node kind");
+  }
+
+  LLVM_ATTRIBUTE_NOINLINE void walkGSM(GSM &Node)
+  {
+    getDerived().visitGSM(Node);
+    for (Expr *Statement : Node)
+      walk(Statement);
+  }
+
+  void walkFinal(Final &Node) { getDerived().visitFinal(Node); }
+
+  void walkBinaryOp(BinaryOp &Node) { walkExpr(&Node); }
+
+  LLVM_ATTRIBUTE_NOINLINE void walkEquation(Equation &Node)
+  {
+    getDerived().visitEquation(Node);
+    walk(Node.getLeft());
+    walk(Node.getRight());
+  }
+
+  LLVM_ATTRIBUTE_NOINLINE void walkDeclaration(Declaration &Node)
+  {
+    getDerived().visitDeclaration(Node);
+    if (Node.getExpr())
+      walk(Node.getExpr());
+  }
+
+  void walkConditions(Conditions &Node) { walkExpr(&Node); }
+
+  void walkCondition(Condition &Node) { walkExpr(&Node); }
+
+  void walkBody(llvm::ArrayRef<Expr *> Body) { walkAll(Body); }
+
+  LLVM_ATTRIBUTE_NOINLINE void walkIf(If &Node)
+  {
+    getDerived().visitIf(Node);
+    walk(Node.getCondition());
+    getDerived().walkBody(Node.getBody());
+    walkAll(Node.getElifs());
+    if (Node.getElse())
+      walk(Node.getElse());
+  }
+
+  LLVM_ATTRIBUTE_NOINLINE void walkElif(Elif &Node)
+  {
+    getDerived().visitElif(Node);
+    walk(Node.getCondition());
+    getDerived().walkBody(Node.getBody());
+  }
+
+  LLVM_ATTRIBUTE_NOINLINE void walkElse(Else &Node)
+  {
+    getDerived().visitElse(Node);
+    getDerived().walkBody(Node.getBody());
+  }
+
+  LLVM_ATTRIBUTE_NOINLINE void walkLoop(Loop &Node)
+  {
+    getDerived().visitLoop(Node);
+    walk(Node.getCondition());
+    getDerived().walkBody(Node.getBody());
+  }
+
+  void visitGSM(GSM &) {}
+  void visitFinal(Final &) {}
+  void visitBinaryOp(BinaryOp &) {}
+  void visitEquation(Equation &) {}
+  void visitDeclaration(Declaration &) {}
+  void visitConditions(Conditions &) {}
+  void visitCondition(Condition &) {}
+  void visitIf(If &) {}
+  void visitElif(Elif &) {}
+  void visitElse(Else &) {}
+  void visitLoop(Loop &) {}
+};
+
+#endif
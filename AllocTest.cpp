@@ -0,0 +1,185 @@
+// Counts the heap allocations made by the compiler phases and checks that
+// reading the tree makes none: the child lists of the AST are handed out
+// in place, so the accessors, the walks over the tree and semantic
+// analysis, which only reads it, must not allocate per node.
+//
+// malloc, calloc and realloc are replaced in this executable only, and
+// count while Counting is set. operator new and llvm::SmallVector both
+// allocate through them, so every heap allocation of the compiler is seen.
+#include "ASTWalker.h"
+#include "CodeGen.h"
+#include "ConstFold.h"
+#include "DefUse.h"
+#include "Lexer.h"
+#include "Parser.h"
+#include "Sema.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/raw_ostream.h"
+#include <cstddef>
+#include <string>
+
+namespace
+{
+    // heap allocations, counted while Counting is set
+    bool Counting = false;
+    size_t NumAllocations = 0;
+}
+
+// glibc's own allocator, which the replacements forward to
+extern "C"
+{
+    void *__libc_malloc(size_t Size);
+    void *__libc_calloc(size_t Num, size_t Size);
+    void *__libc_realloc(void *Ptr, size_t Size);
+
+    void *malloc(size_t Size)
+    {
+        NumAllocations += Counting;
+        return __libc_malloc(Size);
+    }
+
+    void *calloc(size_t Num, size_t Size)
+    {
+        NumAllocations += Counting;
+        return __libc_calloc(Num, Size);
+    }
+
+    void *realloc(void *Ptr, size_t Size)
+    {
+        NumAllocations += Counting;
+        return __libc_realloc(Ptr, Size);
+    }
+}
+
+namespace
+{
+    // number of heap allocations made by F
+    template <typename Fn>
+    size_t countAllocations(Fn &&F)
+    {
+        NumAllocations = 0;
+        Counting = true;
+        F();
+        Counting = false;
+        return NumAllocations;
+    }
+
+    // a program with every kind of node; Copies of its blocks follow each
+    // other, so a longer program has more nodes but no more variables
+    std::string program(unsigned Copies)
+    {
+        std::string Text = "int a, b, c = 1;\n";
+        for (unsigned I = 0; I < Copies; ++I)
+            Text += "if a > 0 and b < 9 : begin int d = a * (b + c); a += d; end\n"
+                    "elif a == 2 or c != 3 : begin b = b ^ 2 - c % 4; end\n"
+                    "else : begin int a = 4; c = a / 2; end\n"
+                    "loopc a < 10 : begin int e = a; a = e + 1; end\n";
+        return Text;
+    }
+
+    // calls every accessor of every node and counts the nodes
+    class Reader : public RecursiveASTWalker<Reader>
+    {
+    public:
+        size_t Count = 0;
+
+        void visitGSM(GSM &Node) { Count += Node.getExprs().size(); }
+        void visitFinal(Final &Node) { Count += !Node.getVal().empty(); }
+        void visitBinaryOp(BinaryOp &) { ++Count; }
+        void visitEquation(Equation &) { ++Count; }
+        void visitDeclaration(Declaration &Node)
+        {
+            Count += Node.getVars().size() + Node.getSymbols().size();
+        }
+        void visitConditions(Conditions &) { ++Count; }
+        void visitCondition(Condition &) { ++Count; }
+        void visitIf(If &Node)
+        {
+            Count += Node.getBody().size() + Node.getElifs().size();
+        }
+        void visitElif(Elif &Node) { Count += Node.getBody().size(); }
+        void visitElse(Else &Node) { Count += Node.getBody().size(); }
+        void visitLoop(Loop &Node) { Count += Node.getBody().size(); }
+    };
+
+    struct PhaseCounts
+    {
+        double Nodes;
+        size_t Parse, Semantic, Fold, Uses, Codegen, Reads;
+    };
+
+    // the allocations of each phase on Text, which must compile
+    bool compile(const std::string &Text, PhaseCounts &Counts)
+    {
+        DiagnosticsEngine Diags(llvm::errs());
+        Lexer Lex(Text);
+        Parser P(Lex, Diags);
+        AST *Tree = nullptr;
+        Counts.Parse = countAllocations([&] { Tree = P.parse(); });
+        if (!Tree || P.hasError())
+        {
+            llvm::errs() << "allocations: the program has syntax errors\n";
+            return false;
+        }
+        Counts.Nodes = P.getContext().getNumNodes();
+
+        bool HasError = false;
+        Counts.Semantic =
+            countAllocations([&] { HasError = Sema(Diags).semantic(Tree); });
+        Counts.Fold = countAllocations([&] {
+            HasError |= ConstFold(P.getContext(), Diags).fold(Tree);
+        });
+        if (HasError)
+        {
+            llvm::errs() << "allocations: the program has semantic errors\n";
+            return false;
+        }
+        Counts.Uses = countAllocations([&] { DefUse(Diags).analyze(Tree); });
+
+        llvm::LLVMContext Ctx;
+        std::unique_ptr<llvm::Module> M;
+        Counts.Codegen =
+            countAllocations([&] { M = CodeGen().generate(Tree, Ctx); });
+
+        Counts.Reads = countAllocations([&] {
+            for (unsigned I = 0; I < 16; ++I)
+                Reader().walk(Tree);
+        });
+        return true;
+    }
+}
+
+int main()
+{
+    PhaseCounts Short, Long;
+    if (!compile(program(1), Short) || !compile(program(64), Long))
+        return 1;
+
+    llvm::outs() << "phase     allocations   per node\n";
+    for (auto Phase : {std::make_pair("parse", Long.Parse),
+                       std::make_pair("sema", Long.Semantic),
+                       std::make_pair("fold", Long.Fold),
+                       std::make_pair("def-use", Long.Uses),
+                       std::make_pair("codegen", Long.Codegen),
+                       std::make_pair("reads", Long.Reads)})
+        llvm::outs() << llvm::format("%-8s %12zu %10.3f\n", Phase.first,
+                                     Phase.second, Phase.second / Long.Nodes);
+
+    bool Failed = false;
+    if (Short.Reads || Long.Reads)
+    {
+        llvm::outs() << "allocations: reading the tree allocates!\n";
+        Failed = true;
+    }
+    // the scopes Sema keeps grow with the variables, not with the nodes
+    if (Long.Semantic > Short.Semantic)
+    {
+        llvm::outs() << "allocations: sema allocates " << Short.Semantic
+                     << " times for one copy of the program, "
+                     << Long.Semantic << " for 64!\n";
+        Failed = true;
+    }
+    return Failed;
+}
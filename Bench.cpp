@@ -0,0 +1,527 @@
+#include "Bench.h"
+#include "ASTWalker.h"
+#include "CodeGen.h"
+#include "ConstFold.h"
+#include "DefUse.h"
+#include "FlatAST.h"
+#include "JIT.h"
+#include "Lexer.h"
+#include "Parser.h"
+#include "Sema.h"
+#include "TokenStream.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/Threading.h"
+#include "llvm/Support/raw_ostream.h"
+#include <chrono>
+#include <string>
+#include <vector>
+
+namespace
+{
+    // inputs given on the command line are tiny, so they are repeated until
+    // the measured work is large enough to time reliably
+    std::string replicate(llvm::StringRef Input, size_t MinSize)
+    {
+        std::string Text;
+        if (Input.empty())
+            return Text;
+        Text.reserve(MinSize + Input.size() + 1);
+        while (Text.size() < MinSize)
+        {
+            Text.append(Input.begin(), Input.end());
+            Text.push_back('\n');
+        }
+        return Text;
+    }
+
+    // identifiers are letters only: va, vb, ..., vz, vba, ...
+    std::string varName(unsigned I)
+    {
+        std::string Digits;
+        do
+        {
+            Digits.insert(Digits.begin(), 'a' + I % 26);
+            I /= 26;
+        } while (I);
+        return "v" + Digits;
+    }
+
+    // runs Fn Iterations times and returns the fastest run in seconds
+    template <typename Fn>
+    double bestOf(unsigned Iterations, Fn &&F)
+    {
+        double Best = 0;
+        for (unsigned I = 0; I < Iterations; ++I)
+        {
+            auto Start = std::chrono::steady_clock::now();
+            F();
+            std::chrono::duration<double> Elapsed =
+                std::chrono::steady_clock::now() - Start;
+            if (I == 0 || Elapsed.count() < Best)
+                Best = Elapsed.count();
+        }
+        return Best;
+    }
+
+    // the IR generated from Tree as it was parsed, to compare two trees
+    // with their sharing
+    std::string printIR(AST *Tree)
+    {
+        llvm::LLVMContext Ctx;
+        std::string IR;
+        llvm::raw_string_ostream OS(IR);
+        CodeGen().generate(Tree, Ctx)->print(OS, nullptr);
+        return OS.str();
+    }
+
+    // counts the nodes of a tree through ASTVisitor, i.e. with a virtual
+    // accept and a virtual visit per node
+    class VisitorCounter : public ASTVisitor
+    {
+        void visitBody(llvm::ArrayRef<Expr *> Body)
+        {
+            for (Expr *Statement : Body)
+                Statement->accept(*this);
+        }
+
+    public:
+        size_t Count = 0;
+
+        virtual void visit(GSM &Node) override
+        {
+            ++Count;
+            for (Expr *Statement : Node)
+                Statement->accept(*this);
+        }
+        virtual void visit(Final &) override { ++Count; }
+        virtual void visit(BinaryOp &Node) override
+        {
+            ++Count;
+            Node.getLeft()->accept(*this);
+            Node.getRight()->accept(*this);
+        }
+        virtual void visit(Equation &Node) override
+        {
+            ++Count;
+            Node.getLeft()->accept(*this);
+            Node.getRight()->accept(*this);
+        }
+        virtual void visit(Declaration &Node) override
+        {
+            ++Count;
+            if (Node.getExpr())
+                Node.getExpr()->accept(*this);
+        }
+        virtual void visit(Conditions &Node) override
+        {
+            ++Count;
+            Node.getLeft()->accept(*this);
+            Node.getRight()->accept(*this);
+        }
+        virtual void visit(Condition &Node) override
+        {
+            ++Count;
+            Node.getLeft()->accept(*this);
+            Node.getRight()->accept(*this);
+        }
+        virtual void visit(If &Node) override
+        {
+            ++Count;
+            Node.getCondition()->accept(*this);
+            visitBody(Node.getBody());
+            for (Elif *Branch : Node.getElifs())
+                Branch->accept(*this);
+            if (Node.getElse())
+                Node.getElse()->accept(*this);
+        }
+        virtual void visit(Elif &Node) override
+        {
+            ++Count;
+            Node.getCondition()->accept(*this);
+            visitBody(Node.getBody());
+        }
+        virtual void visit(Else &Node) override
+        {
+            ++Count;
+            visitBody(Node.getBody());
+        }
+        virtual void visit(Loop &Node) override
+        {
+            ++Count;
+            Node.getCondition()->accept(*this);
+            visitBody(Node.getBody());
+        }
+    };
+
+    // the same count through RecursiveASTWalker
+    class WalkerCounter : public RecursiveASTWalker<WalkerCounter>
+    {
+    public:
+        size_t Count = 0;
+
+        void visitGSM(GSM &) { ++Count; }
+        void visitFinal(Final &) { ++Count; }
+        void visitBinaryOp(BinaryOp &) { ++Count; }
+        void visitEquation(Equation &) { ++Count; }
+        void visitDeclaration(Declaration &) { ++Count; }
+        void visitConditions(Conditions &) { ++Count; }
+        void visitCondition(Condition &) { ++Count; }
+        void visitIf(If &) { ++Count; }
+        void visitElif(Elif &) { ++Count; }
+        void visitElse(Else &) { ++Count; }
+        void visitLoop(Loop &) { ++Count; }
+    };
+
+    // the keyword lookup the lexer used before the perfect hash; kept out of
+    // line like Lexer::getKeywordKind so both pay for the call
+    LLVM_ATTRIBUTE_NOINLINE Token::TokenKind
+    getKeywordKindByCompare(llvm::StringRef Name)
+    {
+        if (Name == "int")
+            return Token::KW_int;
+        if (Name == "if")
+            return Token::KW_if;
+        if (Name == "elif")
+            return Token::KW_elif;
+        if (Name == "else")
+            return Token::KW_else;
+        if (Name == "loopc")
+            return Token::KW_loopc;
+        if (Name == "begin")
+            return Token::KW_begin;
+        if (Name == "end")
+            return Token::KW_end;
+        if (Name == "and")
+            return Token::KW_and;
+        if (Name == "or")
+            return Token::KW_or;
+        return Token::id;
+    }
+
+    // the values a program run by Bench::cse writes
+    std::vector<int> *Written;
+
+    void record(int Value) { Written->push_back(Value); }
+
+    const char *getScanName(Lexer::ScanKind Kind)
+    {
+        switch (Kind)
+        {
+        case Lexer::Scalar:
+            return "scalar";
+        case Lexer::SSE2:
+            return "sse2";
+        case Lexer::AVX2:
+            return "avx2";
+        }
+        return "unknown";
+    }
+}
+
+void Bench::lexer(llvm::StringRef Input)
+{
+    std::string Text = replicate(Input, 16 << 20);
+    double MB = Text.size() / (1024.0 * 1024.0);
+
+    unsigned ScalarTokens = 0, ScalarHash = 0;
+    for (unsigned K = Lexer::Scalar; K <= Lexer::getBestScanKind(); ++K)
+    {
+        Lexer::ScanKind Kind = static_cast<Lexer::ScanKind>(K);
+        unsigned Tokens = 0, Hash = 0;
+        double Secs = bestOf(Iterations, [&] {
+            Lexer Lex(Text, Kind);
+            Token Tok;
+            Tokens = Hash = 0;
+            do
+            {
+                Lex.next(Tok);
+                ++Tokens;
+                Hash = Hash * 31 + Tok.getKind() + Tok.getText().size();
+            } while (!Tok.is(Token::eoi));
+        });
+
+        llvm::outs() << llvm::format("lexer %-6s %10.1f MB/s  %u tokens",
+                                     getScanName(Kind), MB / Secs, Tokens);
+        if (Kind == Lexer::Scalar)
+        {
+            ScalarTokens = Tokens;
+            ScalarHash = Hash;
+        }
+        else if (Tokens != ScalarTokens || Hash != ScalarHash)
+            llvm::outs() << "  (token stream differs from scalar!)";
+        llvm::outs() << "\n";
+    }
+}
+
+void Bench::keywords(llvm::StringRef Input)
+{
+    // collect every identifier and keyword of the input
+    std::string Text = replicate(Input, 4 << 20);
+    std::vector<llvm::StringRef> Names;
+    Lexer Lex(Text);
+    Token Tok;
+    for (Lex.next(Tok); !Tok.is(Token::eoi); Lex.next(Tok))
+        if (Tok.is(Token::id) || Lexer::getKeywordKind(Tok.getText()) != Token::id)
+            Names.push_back(Tok.getText());
+    if (Names.empty())
+    {
+        llvm::outs() << "keywords: the input has no identifiers\n";
+        return;
+    }
+
+    unsigned NumKeywords = 0, Mismatches = 0;
+    for (llvm::StringRef Name : Names)
+    {
+        Token::TokenKind Kind = Lexer::getKeywordKind(Name);
+        NumKeywords += Kind != Token::id;
+        Mismatches += Kind != getKeywordKindByCompare(Name);
+    }
+
+    unsigned Sink = 0;
+    double HashSecs = bestOf(Iterations, [&] {
+        for (llvm::StringRef Name : Names)
+            Sink += Lexer::getKeywordKind(Name);
+    });
+    double CompareSecs = bestOf(Iterations, [&] {
+        for (llvm::StringRef Name : Names)
+            Sink += getKeywordKindByCompare(Name);
+    });
+
+    double Millions = Names.size() / 1e6;
+    llvm::outs() << llvm::format("keywords %zu names, %u keywords (checksum %u)\n",
+                                 Names.size(), NumKeywords, Sink & 0xff);
+    llvm::outs() << llvm::format("keywords perfect-hash %10.1f M lookups/s\n",
+                                 Millions / HashSecs);
+    llvm::outs() << llvm::format("keywords compare     %10.1f M lookups/s\n",
+                                 Millions / CompareSecs);
+    if (Mismatches)
+        llvm::outs() << "keywords: " << Mismatches
+                     << " names classified differently!\n";
+}
+
+void Bench::parser(llvm::StringRef Input)
+{
+    std::string Text = replicate(Input, 4 << 20);
+    double MB = Text.size() / (1024.0 * 1024.0);
+
+    size_t Nodes = 0;
+    bool HasError = false;
+    double Secs = bestOf(Iterations, [&] {
+        Lexer Lex(Text);
+        Parser P(Lex, Diags);
+        HasError = !P.parse() || P.hasError();
+        Nodes = P.getContext().getNumNodes();
+    });
+
+    llvm::outs() << llvm::format("parser %10.1f MB/s %10.1f M nodes/s  %zu nodes\n",
+                                 MB / Secs, Nodes / Secs / 1e6, Nodes);
+    if (HasError)
+    {
+        llvm::outs() << "parser: the input has syntax errors\n";
+        return;
+    }
+
+    // -parse-threads: parsing the token stream alone, with 1 thread the
+    // serial parse(). Every tree must give the IR of the serial one; it is
+    // parsed with hash-consing, so sharing across chunks is checked too.
+    TokenStream Tokens(Text);
+    unsigned MaxThreads = llvm::hardware_concurrency().compute_thread_count();
+    llvm::SmallVector<unsigned, 4> Sweep{1, 2, 4};
+    if (MaxThreads > 4)
+        Sweep.push_back(MaxThreads);
+    auto parse = [&](Parser &P, unsigned Threads) {
+        return Threads == 1 ? P.parse() : P.parseParallel(Threads);
+    };
+    double SerialSecs = 0;
+    std::string SerialIR;
+    for (unsigned Threads : Sweep)
+    {
+        double Secs = bestOf(Iterations, [&] {
+            Parser P(Tokens, Diags);
+            parse(P, Threads);
+        });
+        Parser P(Tokens, Diags);
+        P.getContext().setHashConsing(true);
+        std::string IR = printIR(parse(P, Threads));
+        if (Threads == 1)
+        {
+            SerialSecs = Secs;
+            SerialIR = std::move(IR);
+        }
+        llvm::outs() << llvm::format("parser %2u thread%-1s %10.1f MB/s %6.2fx\n",
+                                     Threads, Threads == 1 ? "" : "s",
+                                     MB / Secs, SerialSecs / Secs);
+        if (Threads != 1 && IR != SerialIR)
+            llvm::outs() << "parser: the tree of " << Threads
+                         << " threads gives other IR than the serial one!\n";
+    }
+}
+
+void Bench::nesting()
+{
+    llvm::outs() << "     depth   parse ns/level compile ns/level\n";
+    for (unsigned Depth = 1 << 10; Depth <= 1 << 20; Depth *= 4)
+    {
+        // the loop keeps a unknown, so nothing is folded away:
+        // int a = 0; int x; loopc a < 1 : begin a += 1;
+        //   x = (a + (a + (... (a + a) ...))); end
+        std::string Text = "int a = 0; int x; loopc a < 1 : begin a += 1; x = ";
+        Text.reserve(Text.size() + Depth * 6 + 10);
+        for (unsigned I = 0; I < Depth; ++I)
+            Text += "(a + ";
+        Text += "a";
+        Text.append(Depth, ')');
+        Text += "; end";
+
+        bool HasError = false;
+        double ParseSecs = bestOf(Iterations, [&] {
+            Lexer Lex(Text);
+            Parser P(Lex, Diags);
+            HasError = !P.parse() || P.hasError();
+        });
+        // every pass of a compile after the parse walks the expression
+        double CompileSecs = bestOf(Iterations, [&] {
+            Lexer Lex(Text);
+            Parser P(Lex, Diags);
+            AST *Tree = P.parse();
+            if (!Tree || P.hasError() || Sema(Diags).semantic(Tree) ||
+                ConstFold(P.getContext(), Diags).fold(Tree))
+            {
+                HasError = true;
+                return;
+            }
+            DefUse(Diags).analyze(Tree);
+            FlatAST::build(Tree);
+            llvm::LLVMContext Ctx;
+            CodeGen().generate(Tree, Ctx);
+        });
+
+        llvm::outs() << llvm::format("%10u %16.2f %16.2f\n", Depth,
+                                     ParseSecs * 1e9 / Depth,
+                                     CompileSecs * 1e9 / Depth);
+        if (HasError)
+            llvm::outs() << "nesting: the generated input has errors\n";
+    }
+}
+
+void Bench::scopes()
+{
+    const unsigned Vars = 64; // declared by every block
+
+    llvm::outs() << "     depth    decls   tree ns/decl   flat ns/decl\n";
+    for (unsigned Depth = 16; Depth <= 1024; Depth *= 4)
+    {
+        // int va, ..., vcl = 1;
+        // if va > 0 : begin int va, ..., vcl = va; vb = va + vcl;
+        //   if va > 0 : begin ... end
+        // end
+        std::string Decl = "int " + varName(0);
+        for (unsigned I = 1; I < Vars; ++I)
+            Decl += ", " + varName(I);
+        std::string Text = Decl + " = 1;\n";
+        for (unsigned I = 0; I < Depth; ++I)
+            Text += "if va > 0 : begin " + Decl + " = va; vb = va + " +
+                    varName(Vars - 1) + ";\n";
+        Text.append(Depth, ' ');
+        for (unsigned I = 0; I < Depth; ++I)
+            Text += "end ";
+
+        Lexer Lex(Text);
+        Parser P(Lex, Diags);
+        AST *Tree = P.parse();
+        if (!Tree || P.hasError())
+        {
+            llvm::outs() << "scopes: the generated input has syntax errors\n";
+            return;
+        }
+        FlatAST Flat = FlatAST::build(Tree);
+
+        bool HasError = false;
+        double TreeSecs = bestOf(Iterations, [&] {
+            HasError |= Sema(Diags).semantic(Tree);
+        });
+        double FlatSecs = bestOf(Iterations, [&] {
+            HasError |= Sema(Diags).semantic(Flat);
+        });
+
+        unsigned Decls = (Depth + 1) * Vars;
+        llvm::outs() << llvm::format("%10u %8u %14.2f %14.2f\n", Depth, Decls,
+                                     TreeSecs * 1e9 / Decls,
+                                     FlatSecs * 1e9 / Decls);
+        if (HasError)
+            llvm::outs() << "scopes: the generated input has semantic errors\n";
+    }
+}
+
+void Bench::traversal(llvm::StringRef Input)
+{
+    std::string Text = replicate(Input, 4 << 20);
+    Lexer Lex(Text);
+    Parser P(Lex, Diags);
+    AST *Tree = P.parse();
+    if (!Tree || P.hasError())
+    {
+        llvm::outs() << "traversal: the input has syntax errors\n";
+        return;
+    }
+
+    size_t Nodes = 0;
+    double VisitorSecs = bestOf(Iterations, [&] {
+        VisitorCounter Counter;
+        Tree->accept(Counter);
+        Nodes = Counter.Count;
+    });
+    double WalkerSecs = bestOf(Iterations, [&] {
+        WalkerCounter Counter;
+        Counter.walk(Tree);
+        Nodes = Counter.Count;
+    });
+
+    llvm::outs() << llvm::format("visitor %10.2f ns/node\n",
+                                 VisitorSecs * 1e9 / Nodes);
+    llvm::outs() << llvm::format("walker  %10.2f ns/node  %zu nodes\n",
+                                 WalkerSecs * 1e9 / Nodes, Nodes);
+}
+
+void Bench::cse(llvm::StringRef Input)
+{
+    // The tree is compiled as parsed: folding would leave fewer
+    // expressions to share
+    std::vector<int> Values[2];
+    for (bool Share : {false, true})
+    {
+        Lexer Lex(Input);
+        Parser P(Lex, Diags);
+        P.getContext().setHashConsing(Share);
+        AST *Tree = P.parse();
+        if (!Tree || P.hasError() || Sema(Diags).semantic(Tree))
+        {
+            llvm::outs() << "cse: the input has errors\n";
+            return;
+        }
+
+        CodeGen Gen;
+        auto Ctx = std::make_unique<llvm::LLVMContext>();
+        std::unique_ptr<llvm::Module> M;
+        double Secs = bestOf(Iterations, [&] {
+            M.reset();
+            M = Gen.generate(Tree, *Ctx);
+        });
+        size_t Instructions = 0;
+        for (llvm::Function &Fn : *M)
+            Instructions += Fn.getInstructionCount();
+        llvm::outs() << llvm::format("cse %-3s %10zu instructions %10.1f us\n",
+                                     Share ? "on" : "off", Instructions,
+                                     Secs * 1e6);
+
+        int ExitCode;
+        Written = &Values[Share];
+        if (JIT(llvm::errs(), record).run(std::move(Ctx), std::move(M), ExitCode))
+            return;
+    }
+
+    if (Values[0] != Values[1])
+        llvm::outs() << "cse: the program writes other values with -cse!\n";
+}
@@ -0,0 +1,47 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include "Diagnostics.h"
+#include "llvm/ADT/StringRef.h"
+
+// Bench runs micro-benchmarks of the compiler phases on the driver input
+// and prints the results to the standard output
+class Bench
+{
+    unsigned Iterations; // number of timed runs, the best one is reported
+    DiagnosticsEngine Diags; // errors in the inputs are counted, not printed
+
+public:
+    Bench(unsigned Iterations)
+        : Iterations(Iterations ? Iterations : 1), Diags(llvm::nulls())
+    {
+    }
+
+    // lexer throughput in MB/s for every scanner the host supports
+    void lexer(llvm::StringRef Input);
+
+    // keyword lookup through the perfect hash against a compare chain
+    void keywords(llvm::StringRef Input);
+
+    // parser throughput, i.e. lexing and building the AST, then parsing
+    // a token stream on 1, 2, 4 and all threads and the speedup of each
+    // over the serial parse
+    void parser(llvm::StringRef Input);
+
+    // cost of a node count through ASTVisitor and RecursiveASTWalker
+    void traversal(llvm::StringRef Input);
+
+    // size and time of the IR generated with and without -cse; both are
+    // run with the JIT and the values they write compared
+    void cse(llvm::StringRef Input);
+
+    // time per level of generated expressions against their nesting
+    // depth, to parse them and to compile them to IR
+    void nesting();
+
+    // Sema time of generated blocks, nested ever deeper, that all declare
+    // the same variables again
+    void scopes();
+};
+
+#endif
@@ -1,16 +1,52 @@
 #include "CodeGen.h"
-#include "llvm/ADT/StringMap.h"
+#include "ASTWalker.h"
+#include "JIT.h"
+#include "ScopedSymbolTable.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SetVector.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/IR/CFG.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/PassInstrumentation.h"
+#include "llvm/IR/PassTimingInfo.h"
+#include "llvm/IR/ValueHandle.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Passes/StandardInstrumentations.h"
+#include "llvm/Support/Format.h"
 #include "llvm/Support/raw_ostream.h"
+#include <memory>
+#include <vector>
 
 using namespace llvm;
 
-// Define a visitor class for generating LLVM IR from the AST.
 namespace
 {
-  class ToIRVisitor : public ASTVisitor
+  // IREmitter holds the module state and builds the instructions that both
+  // code generators need, the one walking the pointer tree and the one
+  // walking a FlatAST.
+  //
+  // Variables live in SSA values from the start, built on the fly as in
+  // Braun et al., "Simple and Efficient Construction of Static Single
+  // Assignment Form": an assignment records the value as the variable's
+  // definition in the current block, and a read looks the definition up,
+  // or asks the predecessors for theirs and joins them in a phi. A block
+  // is sealed once all its predecessors are emitted; until then a read
+  // there gets an operandless phi, completed when the block is sealed.
+  // Phis whose operands all agree are replaced by that value as soon as
+  // they are complete, so no promotion pass has to run over the IR.
+  //
+  // With a partition size the top-level statements are emitted in chunks,
+  // each into a function of its own that main calls in turn, so that the
+  // optimizer and the code generator see functions of bounded size and can
+  // work on several at once. The top-level variables then live in a global
+  // state struct between the chunks: a chunk loads a variable the first
+  // time it reads it before assigning it, and stores the variables it
+  // assigns when it returns.
+  class IREmitter
   {
+  protected:
     Module *M;
     IRBuilder<> Builder;
     Type *VoidTy;
@@ -18,13 +54,189 @@ namespace
     Type *Int8PtrTy;
     Type *Int8PtrPtrTy;
     Constant *Int32Zero;
+    Function *MainFn;
+    Function *Fn; // function the statements go to, main or a chunk
 
-    Value *V;
-    StringMap<AllocaInst *> nameMap;
+    // variable of each symbol in scope, numbered in declaration order
+    ScopedSymbolTable<unsigned> Vars;
 
-  public:
-    // Constructor for the visitor class.
-    ToIRVisitor(Module *M) : M(M), Builder(M->getContext())
+  private:
+    struct BlockState
+    {
+      bool Sealed = false;
+      // phis created while the predecessors were not all known, with
+      // their variable
+      SmallVector<std::pair<unsigned, PHINode *>, 4> IncompletePhis;
+    };
+
+    // definition of each variable in the blocks it has been looked up or
+    // assigned in, by variable; the handles follow a phi replaced by its
+    // value
+    std::vector<DenseMap<BasicBlock *, WeakTrackingVH>> CurrentDef;
+    DenseMap<BasicBlock *, BlockState> Blocks;
+
+    // top-level statements per chunk function, 0 to emit them all in main
+    unsigned PartitionSize;
+    unsigned NumChunks = 0;
+    StructType *StateTy = nullptr;
+    GlobalVariable *State = nullptr;
+    // field of each variable in the state struct, by variable; NoField for
+    // the variables of a body, which do not outlive their chunk
+    static constexpr unsigned NoField = ~0u;
+    std::vector<unsigned> StateField;
+    unsigned NumStateFields = 0;
+    SmallSetVector<unsigned, 16> StateWrites; // assigned in this chunk
+
+    Constant *getStateField(unsigned Var)
+    {
+      return ConstantExpr::getInBoundsGetElementPtr(
+          StateTy, State,
+          ArrayRef<Constant *>{Int32Zero,
+                               ConstantInt::get(Int32Ty, StateField[Var])});
+    }
+
+    // The value of Var on entry to a function: what an earlier chunk left
+    // in the state, or undefined if Var is not assigned before
+    Value *readOnEntry(unsigned Var, BasicBlock *Entry)
+    {
+      if (StateField[Var] == NoField)
+        // read before any assignment, Sema allows it
+        return UndefValue::get(Int32Ty);
+      return Entry->empty()
+                 ? new LoadInst(Int32Ty, getStateField(Var), "", Entry)
+                 : new LoadInst(Int32Ty, getStateField(Var), "", &Entry->front());
+    }
+
+    void writeVariable(unsigned Var, BasicBlock *BB, Value *Val)
+    {
+      CurrentDef[Var][BB] = Val;
+    }
+
+    PHINode *createPhi(BasicBlock *BB)
+    {
+      return BB->empty() ? PHINode::Create(Int32Ty, 2, "", BB)
+                         : PHINode::Create(Int32Ty, 2, "", &BB->front());
+    }
+
+    // The definition of Var reaching BB. Where BB has none, the search goes
+    // back through the predecessors as in the paper, but on an explicit
+    // worklist rather than by recursion: a read after thousands of ifs
+    // that do not assign the variable walks back through all of them.
+    Value *readVariable(unsigned Var, BasicBlock *BB)
+    {
+      DenseMap<BasicBlock *, WeakTrackingVH> &Defs = CurrentDef[Var];
+      auto It = Defs.find(BB);
+      if (It != Defs.end())
+        return It->second;
+
+      SmallVector<BasicBlock *, 8> Worklist{BB};
+      SmallPtrSet<BasicBlock *, 8> Visited;
+      SmallVector<BasicBlock *, 8> Forwarded; // sealed, one predecessor
+      SmallVector<PHINode *, 8> Joins;        // sealed, more predecessors
+      while (!Worklist.empty())
+      {
+        BasicBlock *Block = Worklist.pop_back_val();
+        if (Defs.count(Block) || !Visited.insert(Block).second)
+          continue;
+        if (!Blocks[Block].Sealed)
+        {
+          PHINode *Phi = createPhi(Block);
+          Blocks[Block].IncompletePhis.emplace_back(Var, Phi);
+          Defs[Block] = Phi;
+        }
+        else if (pred_empty(Block))
+          Defs[Block] = readOnEntry(Var, Block);
+        else if (BasicBlock *Pred = Block->getSinglePredecessor())
+        {
+          Forwarded.push_back(Block);
+          Worklist.push_back(Pred);
+        }
+        else
+        {
+          // the phi is the definition before its operands are known,
+          // which breaks the cycles through loops
+          PHINode *Phi = createPhi(Block);
+          Defs[Block] = Phi;
+          Joins.push_back(Phi);
+          Worklist.append(pred_begin(Block), pred_end(Block));
+        }
+      }
+
+      // A block with one predecessor has its definition; chains of them
+      // end at a block with a definition, there is no cycle without a join.
+      SmallVector<BasicBlock *, 8> Chain;
+      for (BasicBlock *Block : Forwarded)
+      {
+        for (; !Defs.count(Block); Block = Block->getSinglePredecessor())
+          Chain.push_back(Block);
+        Value *Def = Defs[Block];
+        for (BasicBlock *Link : Chain)
+          Defs[Link] = Def;
+        Chain.clear();
+      }
+
+      for (PHINode *Phi : Joins)
+        for (BasicBlock *Pred : predecessors(Phi->getParent()))
+          Phi->addIncoming(Defs[Pred], Pred);
+      // Innermost first, as the recursion of the paper would: a chain of
+      // trivial phis then goes one by one, while from the outside in every
+      // replacement would move the handles of all those before it again.
+      SmallVector<WeakVH, 8> Complete(Joins.rbegin(), Joins.rend());
+      for (WeakVH &Phi : Complete)
+        if (auto *Join = dyn_cast_or_null<PHINode>(Phi))
+          tryRemoveTrivialPhi(Join);
+      return Defs[BB];
+    }
+
+    void addPhiOperands(unsigned Var, PHINode *Phi)
+    {
+      for (BasicBlock *Pred : predecessors(Phi->getParent()))
+        Phi->addIncoming(readVariable(Var, Pred), Pred);
+      tryRemoveTrivialPhi(Phi);
+    }
+
+    // Replaces a phi that merges one value, apart from itself, by that
+    // value; the phis using it may be left merging one value in turn, and
+    // are tried next. The definitions and shared values holding a phi are
+    // value handles, which follow it to its replacement.
+    void tryRemoveTrivialPhi(PHINode *Phi)
+    {
+      SmallVector<WeakVH, 8> Worklist{Phi};
+      while (!Worklist.empty())
+      {
+        auto *P = dyn_cast_or_null<PHINode>(Worklist.pop_back_val());
+        if (!P)
+          continue;
+        Value *Same = nullptr;
+        bool Trivial = true;
+        for (Value *Op : P->incoming_values())
+        {
+          if (Op == Same || Op == P)
+            continue;
+          if (Same)
+          {
+            Trivial = false;
+            break;
+          }
+          Same = Op;
+        }
+        if (!Trivial)
+          continue;
+        if (!Same)
+          Same = UndefValue::get(Int32Ty);
+
+        for (User *U : P->users())
+          if (U != P && isa<PHINode>(U))
+            Worklist.push_back(U);
+        P->replaceAllUsesWith(Same);
+        P->eraseFromParent();
+      }
+    }
+
+  protected:
+    IREmitter(Module *M, unsigned PartitionSize)
+        : M(M), Builder(M->getContext()), MainFn(nullptr), Fn(nullptr),
+          PartitionSize(PartitionSize)
     {
       // Initialize LLVM types and constants.
       VoidTy = Type::getVoidTy(M->getContext());
@@ -34,200 +246,767 @@ namespace
       Int32Zero = ConstantInt::get(Int32Ty, 0, true);
     }
 
-    // Entry point for generating LLVM IR from the AST.
-    void run(AST *Tree)
+    // Creates the main function and starts inserting into its entry block.
+    void beginMain()
     {
-      // Create the main function with the appropriate function type.
       FunctionType *MainFty = FunctionType::get(Int32Ty, {Int32Ty, Int8PtrPtrTy}, false);
-      Function *MainFn = Function::Create(MainFty, GlobalValue::ExternalLinkage, "main", M);
+      MainFn = Fn = Function::Create(MainFty, GlobalValue::ExternalLinkage, "main", M);
+      BasicBlock *Entry = BasicBlock::Create(M->getContext(), "entry", MainFn);
+      sealBlock(Entry);
+      Builder.SetInsertPoint(Entry);
+    }
+
+    // Returns 0 from the main function.
+    void endMain() { Builder.CreateRet(Int32Zero); }
+
+    // Emits the NumStatements top-level statements, which declare
+    // NumVars variables, with EmitStatement(I), in chunks if partitioning.
+    template <typename StatementFn>
+    void emitTopLevel(unsigned NumStatements, unsigned NumVars,
+                      StatementFn EmitStatement)
+    {
+      if (!PartitionSize)
+      {
+        for (unsigned I = 0; I < NumStatements; ++I)
+          EmitStatement(I);
+        return;
+      }
+      if (NumVars)
+      {
+        StateTy = StructType::create(
+            M->getContext(), SmallVector<Type *, 16>(NumVars, Int32Ty),
+            "gsm.state");
+        State = new GlobalVariable(*M, StateTy, false,
+                                   GlobalValue::InternalLinkage,
+                                   ConstantAggregateZero::get(StateTy),
+                                   "gsm.state");
+      }
+      for (unsigned Begin = 0; Begin < NumStatements; Begin += PartitionSize)
+      {
+        beginChunk();
+        for (unsigned I = Begin, E = std::min(Begin + PartitionSize, NumStatements);
+             I < E; ++I)
+          EmitStatement(I);
+        endChunk();
+      }
+    }
 
-      // Create a basic block for the entry point of the main function.
-      BasicBlock *BB = BasicBlock::Create(M->getContext(), "entry", MainFn);
-      Builder.SetInsertPoint(BB);
+    // Starts a chunk function and calls it from main.
+    void beginChunk()
+    {
+      Fn = Function::Create(FunctionType::get(VoidTy, false),
+                            GlobalValue::InternalLinkage,
+                            "gsm.chunk." + Twine(NumChunks++), M);
+      // called once, the inliner would put it back into main
+      Fn->addFnAttr(Attribute::NoInline);
+      Builder.CreateCall(Fn);
+      BasicBlock *Entry = BasicBlock::Create(M->getContext(), "entry", Fn);
+      sealBlock(Entry);
+      Builder.SetInsertPoint(Entry);
+    }
 
-      // Visit the root node of the AST to generate IR.
-      Tree->accept(*this);
+    // Leaves the top-level variables the chunk assigned in the state and
+    // goes back to main.
+    void endChunk()
+    {
+      for (unsigned Var : StateWrites)
+        Builder.CreateStore(readVariable(Var, Builder.GetInsertBlock()),
+                            getStateField(Var));
+      StateWrites.clear();
+      Builder.CreateRetVoid();
+      Fn = MainFn;
+      Builder.SetInsertPoint(&MainFn->getEntryBlock());
+    }
 
-      // Create a return instruction at the end of the main function.
-      Builder.CreateRet(Int32Zero);
+    BasicBlock *createBlock(const Twine &Name)
+    {
+      return BasicBlock::Create(M->getContext(), Name, Fn);
     }
 
-    // Visit function for the GSM node in the AST.
-    virtual void visit(GSM &Node) override
+    // Called once all predecessors of BB have their branch to it.
+    void sealBlock(BasicBlock *BB)
     {
-      // Iterate over the children of the GSM node and visit each child.
-      for (auto I = Node.begin(), E = Node.end(); I != E; ++I)
+      BlockState &State = Blocks[BB];
+      State.Sealed = true;
+      auto Phis = std::move(State.IncompletePhis);
+      for (auto &VarPhi : Phis)
+        addPhiOperands(VarPhi.first, VarPhi.second);
+    }
+
+    Value *emitLiteral(StringRef Literal)
+    {
+      int intval = 0;
+      Literal.getAsInteger(10, intval);
+      return ConstantInt::get(Int32Ty, intval, true);
+    }
+
+    // Sema has made sure every variable is declared before it is used.
+    Value *emitRead(unsigned Symbol)
+    {
+      return readVariable(Vars.lookup(Symbol), Builder.GetInsertBlock());
+    }
+
+    // Declares a new variable in the current scope. Until it is assigned
+    // it is undefined, also when a loop body declares it again.
+    void emitDeclare(unsigned Symbol)
+    {
+      unsigned Var = CurrentDef.size();
+      CurrentDef.emplace_back();
+      StateField.push_back(State && Vars.getDepth() == 1 ? NumStateFields++
+                                                         : NoField);
+      Vars.declare(Symbol, Var);
+      writeVariable(Var, Builder.GetInsertBlock(), UndefValue::get(Int32Ty));
+    }
+
+    void emitInit(unsigned Symbol, Value *Init)
+    {
+      unsigned Var = Vars.lookup(Symbol);
+      writeVariable(Var, Builder.GetInsertBlock(), Init);
+      if (StateField[Var] != NoField)
+        StateWrites.insert(Var);
+    }
+
+    // Assigns a variable, unless nothing reads the value, and prints the
+    // new value through gsm_write.
+    void emitAssign(unsigned Symbol, Value *Val, bool DeadStore)
+    {
+      if (!DeadStore)
+        emitInit(Symbol, Val);
+      FunctionCallee WriteFn = M->getOrInsertFunction(
+          "gsm_write", FunctionType::get(VoidTy, {Int32Ty}, false));
+      Builder.CreateCall(WriteFn, {Val});
+    }
+
+    // Conditions are i1, a comparison of conditions compares them as 0 or 1.
+    Value *toInt32(Value *V)
+    {
+      return V->getType() == Int32Ty ? V : Builder.CreateZExt(V, Int32Ty);
+    }
+
+    Value *emitBinaryOp(BinaryOp::Operator Op, Value *Left, Value *Right)
+    {
+      switch (Op)
+      {
+      case BinaryOp::Plus:
+        return Builder.CreateNSWAdd(Left, Right);
+      case BinaryOp::Minus:
+        return Builder.CreateNSWSub(Left, Right);
+      case BinaryOp::star:
+        return Builder.CreateNSWMul(Left, Right);
+      case BinaryOp::slash:
+        return Builder.CreateSDiv(Left, Right);
+      case BinaryOp::KW_mod:
+        return Builder.CreateSRem(Left, Right);
+      case BinaryOp::power:
       {
-        (*I)->accept(*this);
+        // There is no integer power instruction, the runtime provides it.
+        FunctionCallee PowFn = M->getOrInsertFunction(
+            "gsm_pow", FunctionType::get(Int32Ty, {Int32Ty, Int32Ty}, false));
+        return Builder.CreateCall(PowFn, {Left, Right});
       }
-    };
+      default:
+        // The parser rewrites x op= E as x = x op E.
+        llvm_unreachable("assignment operator in an expression");
+      }
+    }
 
-    virtual void visit(Equation &Node) override
+    Value *emitCondition(Condition::OperatorCondition Op, Value *Left, Value *Right)
     {
-      // Visit the right-hand side of the assignment and get its value.
-      Node.getRight()->accept(*this);
-      Value *val = V;
+      Left = toInt32(Left);
+      Right = toInt32(Right);
+      switch (Op)
+      {
+      case Condition::KW_eqNot:
+        return Builder.CreateICmpNE(Left, Right);
+      case Condition::KW_EqEq:
+        return Builder.CreateICmpEQ(Left, Right);
+      case Condition::KW_greaterEqual:
+        return Builder.CreateICmpSGE(Left, Right);
+      case Condition::KW_lessEqual:
+        return Builder.CreateICmpSLE(Left, Right);
+      case Condition::KW_lessThan:
+        return Builder.CreateICmpSLT(Left, Right);
+      case Condition::KW_greaterThan:
+        return Builder.CreateICmpSGT(Left, Right);
+      }
+      llvm_unreachable("unknown comparison");
+    }
 
-      // Get the name of the variable being assigned.
-      auto varName = Node.getLeft()->getVal();
+    Value *emitLogical(Conditions::andOr Op, Value *Left, Value *Right)
+    {
+      // Conditions have no side effects, so both sides are always evaluated.
+      return Op == Conditions::KW_and ? Builder.CreateAnd(Left, Right)
+                                      : Builder.CreateOr(Left, Right);
+    }
 
-      // Create a store instruction to assign the value to the variable.
-      Builder.CreateStore(val, nameMap[varName]);
+    // Emits if/elif/else. EmitCond(I) emits the I-th condition and
+    // returns its value, EmitBody(I) the body guarded by it; with an else
+    // EmitBody(NumConds) is the else body. The branches are sealed as soon
+    // as they are reached, the join once every branch is emitted.
+    template <typename CondFn, typename BodyFn>
+    void emitIf(unsigned NumConds, bool HasElse, CondFn EmitCond, BodyFn EmitBody)
+    {
+      // Placed after the branches once they are emitted.
+      BasicBlock *MergeBB = BasicBlock::Create(M->getContext(), "if.end");
+      for (unsigned I = 0; I < NumConds; ++I)
+      {
+        Value *Cond = EmitCond(I);
+        BasicBlock *ThenBB = createBlock("if.then");
+        BasicBlock *NextBB = I + 1 < NumConds || HasElse ? createBlock("if.else") : MergeBB;
+        Builder.CreateCondBr(Cond, ThenBB, NextBB);
+        sealBlock(ThenBB);
+        Builder.SetInsertPoint(ThenBB);
+        EmitBody(I);
+        Builder.CreateBr(MergeBB);
+        if (NextBB != MergeBB)
+        {
+          sealBlock(NextBB);
+          Builder.SetInsertPoint(NextBB);
+        }
+      }
+      if (HasElse)
+      {
+        EmitBody(NumConds);
+        Builder.CreateBr(MergeBB);
+      }
+      MergeBB->insertInto(Fn);
+      sealBlock(MergeBB);
+      Builder.SetInsertPoint(MergeBB);
+    }
 
-      // Create a function type for the "gsm_write" function.
-      FunctionType *CalcWriteFnTy = FunctionType::get(VoidTy, {Int32Ty}, false);
+    // Emits a loop that runs EmitBody() as long as EmitCond() holds. The
+    // condition block is sealed after the body, which branches back to it.
+    template <typename CondFn, typename BodyFn>
+    void emitLoop(CondFn EmitCond, BodyFn EmitBody)
+    {
+      BasicBlock *CondBB = createBlock("loop.cond");
+      BasicBlock *BodyBB = createBlock("loop.body");
+      BasicBlock *EndBB = createBlock("loop.end");
+      Builder.CreateBr(CondBB);
+      Builder.SetInsertPoint(CondBB);
+      Builder.CreateCondBr(EmitCond(), BodyBB, EndBB);
+      sealBlock(BodyBB);
+      sealBlock(EndBB);
+      Builder.SetInsertPoint(BodyBB);
+      EmitBody();
+      Builder.CreateBr(CondBB);
+      sealBlock(CondBB);
+      Builder.SetInsertPoint(EndBB);
+    }
+  };
+}
 
-      // Create a function declaration for the "gsm_write" function.
-      Function *CalcWriteFn = Function::Create(CalcWriteFnTy, GlobalValue::ExternalLinkage, "gsm_write", M);
+// Define a walker class for generating LLVM IR from the AST. Every walk
+// function is replaced, as the order of the emitted code matters.
+namespace
+{
+  class ToIRVisitor : public RecursiveASTWalker<ToIRVisitor>, IREmitter
+  {
+    Value *V;
 
-      // Create a call instruction to invoke the "gsm_write" function with the value.
-      CallInst *Call = Builder.CreateCall(CalcWriteFnTy, CalcWriteFn, {val});
+    // Values of shared expressions (see ASTContext::getBinaryOp), reused
+    // where the node is reached again. Every assignment counts as a store
+    // and stamps its variable with the store count; a value is stale once a
+    // variable it reads was stamped after it was computed, or if it was
+    // computed in another block. Constants and the definitions a read finds
+    // are stale there too: the block need not be dominated by the one the
+    // value was found in, e.g. behind a loop's back edge.
+    struct SharedValue
+    {
+      WeakTrackingVH V; // follows a phi replaced by its value
+      BasicBlock *Block; // insertion block when computed
+      unsigned Computed; // store count when computed
+      unsigned Checked;  // store count when last found valid
     };
+    DenseMap<Expr *, SharedValue> SharedValues;
+    std::vector<unsigned> LastStore; // store count of the last store, by symbol
+    unsigned NumStores = 0;
 
-    virtual void visit(Final &Node) override
+    void noteStore(unsigned Var)
     {
-      if (Node.getKind() == Final::id)
+      if (Var >= LastStore.size())
+        LastStore.resize(Var + 1);
+      LastStore[Var] = ++NumStores;
+    }
+
+    // the still valid value of a shared node, or nullptr; the operands
+    // must be the values it was computed from, they are checked on a
+    // worklist as a shared node may stand for a deep expression
+    Value *findShared(Expr *Node)
+    {
+      SmallVector<Expr *, 8> Work{Node};
+      SmallVector<SharedValue *, 8> Valid;
+      while (!Work.empty())
       {
-        // If the factor is an identifier, load its value from memory.
-        V = Builder.CreateLoad(Int32Ty, nameMap[Node.getVal()]);
-        
+        auto It = SharedValues.find(Work.pop_back_val());
+        if (It == SharedValues.end())
+          return nullptr;
+        SharedValue &S = It->second;
+        if (S.Block != Builder.GetInsertBlock())
+          return nullptr;
+        if (S.Checked == NumStores)
+          continue;
+
+        if (auto *F = dyn_cast<Final>(It->first))
+        {
+          if (F->getKind() == Final::id && F->getSymbol() < LastStore.size() &&
+              LastStore[F->getSymbol()] > S.Computed)
+            return nullptr;
+        }
+        else
+        {
+          auto *B = cast<BinaryOp>(It->first);
+          for (Expr *Operand : {B->getLeft(), B->getRight()})
+          {
+            auto Op = SharedValues.find(Operand);
+            if (Op == SharedValues.end() || Op->second.Computed > S.Computed)
+              return nullptr;
+            Work.push_back(Operand);
+          }
+        }
+        Valid.push_back(&S);
       }
-      else
+      for (SharedValue *S : Valid)
+        S->Checked = NumStores;
+      return SharedValues.find(Node)->second.V;
+    }
+
+    void rememberShared(Expr *Node, Value *Val)
+    {
+      SharedValues[Node] =
+          SharedValue{Val, Builder.GetInsertBlock(), NumStores, NumStores};
+    }
+
+    // the value of E, its operands computed first, left to right
+    Value *emitExpr(Expr *E)
+    {
+      struct Pending
       {
-        // If the factor is a literal, convert it to an integer and create a constant.
-        int intval;
-        Node.getVal().getAsInteger(10, intval);
-        V = ConstantInt::get(Int32Ty, intval, true);
+        Expr *E;
+        bool OperandsDone; // their values are on top of Operands
+      };
+      SmallVector<Pending, 16> Work{{E, false}};
+      SmallVector<Value *, 16> Operands;
+      while (!Work.empty())
+      {
+        Pending P = Work.pop_back_val();
+        if (auto *F = dyn_cast<Final>(P.E))
+        {
+          walkFinal(*F);
+          Operands.push_back(V);
+          continue;
+        }
+
+        if (!P.OperandsDone)
+        {
+          if (P.E->isShared() && (V = findShared(P.E)))
+          {
+            Operands.push_back(V);
+            continue;
+          }
+          Work.push_back({P.E, true});
+          if (auto *B = dyn_cast<BinaryOp>(P.E))
+          {
+            Work.push_back({B->getRight(), false});
+            Work.push_back({B->getLeft(), false});
+          }
+          else if (auto *Cmp = dyn_cast<Condition>(P.E))
+          {
+            Work.push_back({Cmp->getRight(), false});
+            Work.push_back({Cmp->getLeft(), false});
+          }
+          else
+          {
+            auto *C = cast<Conditions>(P.E);
+            Work.push_back({C->getRight(), false});
+            Work.push_back({C->getLeft(), false});
+          }
+          continue;
+        }
+
+        Value *Right = Operands.pop_back_val();
+        Value *Left = Operands.pop_back_val();
+        if (auto *B = dyn_cast<BinaryOp>(P.E))
+        {
+          V = emitBinaryOp(B->getOperator(), Left, Right);
+          if (B->isShared())
+            rememberShared(B, V);
+        }
+        else if (auto *Cmp = dyn_cast<Condition>(P.E))
+          V = emitCondition(Cmp->getOperator(), Left, Right);
+        else
+          V = emitLogical(cast<Conditions>(P.E)->getAO(), Left, Right);
+        Operands.push_back(V);
       }
+      return Operands.pop_back_val();
+    }
+
+    // a body is a scope of its own
+    void emitBody(ArrayRef<Expr *> Body)
+    {
+      Vars.pushScope();
+      for (Expr *Statement : Body)
+        walk(Statement);
+      Vars.popScope();
+    }
+
+    Value *emitConditions(Conditions *Cond)
+    {
+      walk(Cond);
+      return V;
+    }
+
+  public:
+    // Constructor for the visitor class.
+    ToIRVisitor(Module *M, unsigned PartitionSize)
+        : IREmitter(M, PartitionSize), V(nullptr) {}
+
+    // Entry point for generating LLVM IR from the AST.
+    void run(AST *Tree)
+    {
+      // Create the main function and its entry block.
+      beginMain();
+
+      // Walk the root node of the AST to generate IR.
+      walk(Tree);
+
+      // Create a return instruction at the end of the main function.
+      endMain();
+    }
+
+    // Walk function for the GSM node in the AST.
+    void walkGSM(GSM &Node)
+    {
+      // Walk each statement of the program, counting the variables the
+      // state of a partitioned program has to hold.
+      ArrayRef<Expr *> Exprs = Node.getExprs();
+      unsigned NumVars = 0;
+      for (Expr *E : Exprs)
+        if (auto *Decl = dyn_cast<Declaration>(E))
+          NumVars += Decl->getSymbols().size();
+      emitTopLevel(Exprs.size(), NumVars, [&](unsigned I) { walk(Exprs[I]); });
+    };
+
+    void walkEquation(Equation &Node)
+    {
+      // Visit the right-hand side of the assignment and get its value.
+      walk(Node.getRight());
+
+      // Store the value to the variable and print it.
+      emitAssign(Node.getLeft()->getSymbol(), V, Node.isDeadStore());
+      noteStore(Node.getLeft()->getSymbol());
     };
 
-    virtual void visit(BinaryOp &Node) override
+    void walkFinal(Final &Node)
     {
-      
-      // Visit the left-hand side of the binary operation and get its value.
-      Node.getLeft()->accept(*this);
-      Value *Left = V;
+      if (Node.isShared() && (V = findShared(&Node)))
+        return;
+      if (Node.getKind() == Final::id)
+        // If the factor is an identifier, read its current value.
+        V = emitRead(Node.getSymbol());
+      else
+        // If the factor is a literal, convert it to an integer and create a constant.
+        V = emitLiteral(Node.getVal());
+      if (Node.isShared())
+        rememberShared(&Node, V);
+    };
+
+    // Operators, comparisons and and/or are evaluated in post-order on
+    // explicit stacks, as FlatToIR does, so that an expression is not
+    // limited in depth by the native stack.
+    void walkBinaryOp(BinaryOp &Node) { V = emitExpr(&Node); }
 
-      // Visit the right-hand side of the binary operation and get its value.
-      Node.getRight()->accept(*this);
-      Value *Right = V;
+    void walkCondition(Condition &Node) { V = emitExpr(&Node); }
 
-      // Perform the binary operation based on the operator type and create the corresponding instruction.
-      switch (Node.getOperator())
+    void walkConditions(Conditions &Node) { V = emitExpr(&Node); }
+
+    void walkDeclaration(Declaration &Node)
+    {
+      // Declare every variable; as in Sema, they are in scope in the
+      // initializer.
+      ArrayRef<unsigned> Syms = Node.getSymbols();
+      bool InitIsRead = false;
+      for (unsigned I = 0, E = Syms.size(); I != E; ++I)
       {
-      case BinaryOp::Plus:
-        V = Builder.CreateNSWAdd(Left, Right);
-        break;
-      case BinaryOp::Minus:
-        V = Builder.CreateNSWSub(Left, Right);
-        break;
-      case BinaryOp::equal:
-        V = Builder.CreateNSWMul(Left, Right);
-        break;
-      case BinaryOp::power:
-        V = Builder.CreateSDiv(Left, Right);
-        break;
-      case BinaryOp::star:
-        V = Builder.CreateNSWAdd(Left, Right);
-        break;
-      case BinaryOp::slash:
-        V = Builder.CreateNSWSub(Left, Right);
-        break;
-      case BinaryOp::KW_mod:
-        V = Builder.CreateNSWMul(Left, Right);
-        break;
-      case BinaryOp::KW_plusEqual:
-        V = Builder.CreateSDiv(Left, Right);
-        break;
-      case BinaryOp::KW_minusEqual:
-        V = Builder.CreateNSWAdd(Left, Right);
-        break;
-      case BinaryOp::KW_starEqual:
-        V = Builder.CreateNSWSub(Left, Right);
-        break;
-      case BinaryOp::KW_slashEqual:
-        V = Builder.CreateNSWMul(Left, Right);
-        break;
-      case BinaryOp::KW_modEq:
-        V = Builder.CreateSDiv(Left, Right);
-        break;
+        emitDeclare(Syms[I]);
+        noteStore(Syms[I]);
+        InitIsRead |= Node.getVarUse(I) == Declaration::UseRead;
+      }
+
+      // Compute the initial value, if some variable reads it, and store it.
+      if (!Node.getExpr() || !InitIsRead)
+        return;
+      walk(Node.getExpr());
+      for (unsigned I = 0, E = Syms.size(); I != E; ++I)
+      {
+        if (Node.getVarUse(I) == Declaration::UseRead)
+          emitInit(Syms[I], V);
+        noteStore(Syms[I]);
       }
     };
 
-   virtual void visit(Condition &Node) override
+    void walkIf(If &Node)
     {
-      
-      // Visit the left-hand side of the binary operation and get its value.
-      Node.getLeft()->accept(*this);
-      Value *Left = V;
+      ArrayRef<Elif *> Elifs = Node.getElifs();
+      emitIf(
+          1 + Elifs.size(), Node.getElse() != nullptr,
+          [&](unsigned I) {
+            return emitConditions(I == 0 ? Node.getCondition()
+                                         : Elifs[I - 1]->getCondition());
+          },
+          [&](unsigned I) {
+            if (I == 0)
+              emitBody(Node.getBody());
+            else if (I <= Elifs.size())
+              emitBody(Elifs[I - 1]->getBody());
+            else
+              emitBody(Node.getElse()->getBody());
+          });
+    };
 
-      // Visit the right-hand side of the binary operation and get its value.
-      Node.getRight()->accept(*this);
-      Value *Right = V;
+    void walkLoop(::Loop &Node) // not llvm::Loop
+    {
+      emitLoop([&] { return emitConditions(Node.getCondition()); },
+               [&] { emitBody(Node.getBody()); });
+    };
+  };
 
-      // Perform the binary operation based on the operator type and create the corresponding instruction.
-      switch (Node.getOperator())
+  // FlatToIR generates the same IR from a FlatAST. Statements are handled
+  // by a switch on the node kind; an expression is evaluated by a loop
+  // over its post-order range with the operands on a stack.
+  class FlatToIR : IREmitter
+  {
+    const FlatAST &Tree;
+    SmallVector<Value *, 32> Operands;
+
+    Value *emitExpr(FlatAST::NodeRef N)
+    {
+      for (FlatAST::NodeRef I = Tree.getFirstDescendant(N); I <= N; ++I)
       {
-      case Condition::KW_eqNot:
-        V = Builder.CreateNSWAdd(Left, Right);
+        switch (Tree.getKind(I))
+        {
+        case FlatAST::Num:
+          Operands.push_back(emitLiteral(Tree.getText(I)));
+          continue;
+        case FlatAST::Id:
+          Operands.push_back(emitRead(Tree.getSymbol(I)));
+          continue;
+        default:
+          break;
+        }
+
+        Value *Right = Operands.pop_back_val();
+        Value *Left = Operands.pop_back_val();
+        switch (Tree.getKind(I))
+        {
+        case FlatAST::BinaryOp:
+          Operands.push_back(emitBinaryOp(
+              static_cast<BinaryOp::Operator>(Tree.getOp(I)), Left, Right));
+          break;
+        case FlatAST::Condition:
+          Operands.push_back(emitCondition(
+              static_cast<Condition::OperatorCondition>(Tree.getOp(I)), Left, Right));
+          break;
+        case FlatAST::Conditions:
+          Operands.push_back(emitLogical(
+              static_cast<Conditions::andOr>(Tree.getOp(I)), Left, Right));
+          break;
+        default:
+          llvm_unreachable("statement inside an expression");
+        }
+      }
+      return Operands.pop_back_val();
+    }
+
+    void emitStatement(FlatAST::NodeRef N)
+    {
+      ArrayRef<FlatAST::NodeRef> Kids = Tree.getChildren(N);
+      switch (Tree.getKind(N))
+      {
+      case FlatAST::Program:
+      {
+        unsigned NumVars = 0;
+        for (FlatAST::NodeRef Kid : Kids)
+          if (Tree.getKind(Kid) == FlatAST::Declaration)
+            NumVars += Tree.getChildren(Kid).size() - (Tree.getOp(Kid) != 0);
+        emitTopLevel(Kids.size(), NumVars,
+                     [&](unsigned I) { emitStatement(Kids[I]); });
         break;
-          case Condition::KW_EqEq:
-        V = Builder.CreateNSWAdd(Left, Right);
+      }
+      case FlatAST::Block:
+        Vars.pushScope();
+        for (FlatAST::NodeRef Kid : Kids)
+          emitStatement(Kid);
+        Vars.popScope();
         break;
-             case Condition::KW_greaterEqual:
-        V = Builder.CreateNSWAdd(Left, Right);
+      case FlatAST::Declaration:
+      {
+        // The initializer, if any, follows the declared variables.
+        ArrayRef<FlatAST::NodeRef> Declared =
+            Tree.getOp(N) ? Kids.drop_back() : Kids;
+        bool InitIsRead = false;
+        for (FlatAST::NodeRef Var : Declared)
+        {
+          emitDeclare(Tree.getSymbol(Var));
+          InitIsRead |= Tree.getOp(Var) == Declaration::UseRead;
+        }
+        if (!Tree.getOp(N) || !InitIsRead)
+          break;
+        Value *Init = emitExpr(Kids.back());
+        for (FlatAST::NodeRef Var : Declared)
+          if (Tree.getOp(Var) == Declaration::UseRead)
+            emitInit(Tree.getSymbol(Var), Init);
         break;
-             case Condition::KW_lessEqual:
-        V = Builder.CreateNSWAdd(Left, Right);
+      }
+      case FlatAST::Equation:
+        emitAssign(Tree.getSymbol(Kids[0]), emitExpr(Kids[1]), Tree.getOp(N));
         break;
-             case Condition::KW_greaterThan:
-        V = Builder.CreateNSWAdd(Left, Right);
+      case FlatAST::If:
+      {
+        // conditions, Block, Elif..., optional Else
+        bool HasElse = Tree.getKind(Kids.back()) == FlatAST::Else;
+        unsigned NumConds = Kids.size() - 1 - HasElse;
+        emitIf(
+            NumConds, HasElse,
+            [&](unsigned I) {
+              return emitExpr(I == 0 ? Kids[0] : Tree.getChild(Kids[I + 1], 0));
+            },
+            [&](unsigned I) {
+              if (I == 0)
+                emitStatement(Kids[1]);
+              else if (I < NumConds)
+                emitStatement(Tree.getChild(Kids[I + 1], 1));
+              else
+                emitStatement(Tree.getChild(Kids.back(), 0));
+            });
         break;
-             case Condition::KW_lessThan:
-        V = Builder.CreateNSWAdd(Left, Right);
+      }
+      case FlatAST::Loop:
+        emitLoop([&] { return emitExpr(Kids[0]); },
+                 [&] { emitStatement(Kids[1]); });
         break;
+      default:
+        llvm_unreachable("expression used as a statement");
       }
-    };
+    }
 
-    virtual void visit(Declaration &Node) override
+  public:
+    FlatToIR(Module *M, const FlatAST &Tree, unsigned PartitionSize)
+        : IREmitter(M, PartitionSize), Tree(Tree) {}
+
+    void run()
     {
-      Value *val = nullptr;
+      beginMain();
+      if (!Tree.empty())
+        emitStatement(Tree.getRoot());
+      endMain();
+    }
+  };
+}; // namespace
 
-      if (Node.getExpr())
-      {
-        // If there is an expression provided, visit it and get its value.
-        Node.getExpr()->accept(*this);
-        val = V;
-      }
+// Runs the default pipeline of the new pass manager for the -O level: at
+// -O1 and up that runs instcombine, GVN and the loop passes over the SSA
+// form CodeGen builds. -O0 leaves the IR as built.
+void CodeGen::optimize(Module &M, TargetMachine *TM)
+{
+  LoopAnalysisManager LAM;
+  FunctionAnalysisManager FAM;
+  CGSCCAnalysisManager CGAM;
+  ModuleAnalysisManager MAM;
 
-      // Iterate over the variables declared in the declaration statement.
-      for (auto I = Node.begin(), E = Node.end(); I != E; ++I)
-      {
-        StringRef Var = *I;
+  // With TimePassesIsEnabled, the handler StandardInstrumentations
+  // registers reports the time of every pass when it is destroyed, i.e. at
+  // the end of this function.
+  PassInstrumentationCallbacks PIC;
+  StandardInstrumentations SI(/*DebugLogging=*/false);
+  SI.registerCallbacks(PIC, &FAM);
 
-        // Create an alloca instruction to allocate memory for the variable.
-        nameMap[Var] = Builder.CreateAlloca(Int32Ty);
+  PassBuilder PB(TM, PipelineTuningOptions(), None, &PIC);
+  PB.registerModuleAnalyses(MAM);
+  PB.registerCGSCCAnalyses(CGAM);
+  PB.registerFunctionAnalyses(FAM);
+  PB.registerLoopAnalyses(LAM);
+  PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
 
-        // Store the initial value (if any) in the variable's memory location.
-        if (val != nullptr)
-        {
-          Builder.CreateStore(val, nameMap[Var]);
-        }
-      }
-    };
-  };
-}; // namespace
+  static const OptimizationLevel Levels[] = {
+      OptimizationLevel::O0, OptimizationLevel::O1, OptimizationLevel::O2,
+      OptimizationLevel::O3};
+  OptimizationLevel Level = Levels[OptLevel < 3 ? OptLevel : 3];
+  ModulePassManager MPM = Level == OptimizationLevel::O0
+                              ? PB.buildO0DefaultPipeline(Level)
+                              : PB.buildPerModuleDefaultPipeline(Level);
+  MPM.run(M, MAM);
+}
 
-void CodeGen::compile(AST *Tree)
+bool CodeGen::emit(std::unique_ptr<LLVMContext> Ctx, std::unique_ptr<Module> M)
 {
-  // Create an LLVM context and a module.
-  LLVMContext Ctx;
-  Module *M = new Module("calc.expr", Ctx);
+  // Passes run on several threads at once are not timed.
+  bool Split = !Run && Threads > 1 && Emitter::canSplit(Output);
+  TimePassesIsEnabled = TimePasses && !Split;
+
+  if (Run)
+  {
+    optimize(*M, nullptr);
+    JIT Engine(errs());
+    if (Engine.run(std::move(Ctx), std::move(M), ExitCode))
+      return true;
+    errs() << format("JIT: compiled in %.3f ms, ran in %.3f ms\n",
+                     Engine.getCompileTime() * 1e3, Engine.getRunTime() * 1e3);
+    return false;
+  }
+
+  // Write the module in the requested form; native code is optimized for
+  // the target it is generated for, split across threads if asked to.
+  Emitter Out(Output, OutputFile, RuntimeLib, errs());
+  bool Failed = Out.prepare(*M, OptLevel);
+  if (!Failed && Split)
+    Failed = Out.writeSplit(*M, Threads, [this](Module &Part, TargetMachine *TM) {
+      optimize(Part, TM);
+    });
+  else if (!Failed)
+  {
+    optimize(*M, Out.getTargetMachine());
+    Failed = Out.write(*M);
+  }
+  M.reset(); // a module must go before its context
+  return Failed;
+}
+
+std::unique_ptr<Module> CodeGen::generate(AST *Tree, LLVMContext &Ctx)
+{
+  // Create a module.
+  auto M = std::make_unique<Module>("calc.expr", Ctx);
 
   // Create an instance of the ToIRVisitor and run it on the AST to generate LLVM IR.
-  ToIRVisitor ToIR(M);
+  ToIRVisitor ToIR(M.get(), PartitionSize);
   ToIR.run(Tree);
+  return M;
+}
+
+bool CodeGen::compile(AST *Tree)
+{
+  // Create an LLVM context and generate the module in it.
+  auto Ctx = std::make_unique<LLVMContext>();
+  std::unique_ptr<Module> M = generate(Tree, *Ctx);
+  return emit(std::move(Ctx), std::move(M));
+}
+
+bool CodeGen::compile(const FlatAST &Tree)
+{
+  auto Ctx = std::make_unique<LLVMContext>();
+  auto M = std::make_unique<Module>("calc.expr", *Ctx);
+
+  FlatToIR ToIR(M.get(), Tree, PartitionSize);
+  ToIR.run();
+
+  // A loaded tree passed FlatAST::isWellFormed(), but it comes from a file
+  // anyone may have changed, so the IR built from it is checked before it
+  // is optimized, written or run.
+  if (Tree.isLoaded() && verifyModule(*M, &errs()))
+  {
+    errs() << "The AST file gives invalid IR\n";
+    return true;
+  }
 
-  // Print the generated module to the standard output.
-  M->print(outs(), nullptr);
+  return emit(std::move(Ctx), std::move(M));
 }
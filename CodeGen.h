@@ -2,11 +2,67 @@
 #define CODEGEN_H
 
 #include "AST.h"
+#include "Emitter.h"
+#include "FlatAST.h"
+#include <memory>
+#include <string>
+
+namespace llvm
+{
+  class LLVMContext;
+  class Module;
+  class TargetMachine;
+}
 
 class CodeGen
 {
+ unsigned OptLevel; // -O level of the pipeline run on the module, 0 to 3
+ bool TimePasses;   // print the time taken by every pass
+ bool Run;          // run the program in-process instead of printing it
+ int ExitCode;      // what main returned, if it was run
+ unsigned PartitionSize; // top-level statements per function, 0 for one
+ unsigned Threads;       // threads objects are optimized and compiled on
+ Emitter::FileType Output; // what is written, unless the program is run
+ std::string OutputFile;
+ std::string RuntimeLib;   // static runtime executables are linked with
+
+ // runs the pipeline of the -O level on M, for TM if there is one
+ void optimize(llvm::Module &M, llvm::TargetMachine *TM);
+
+ // optimizes M and writes it out or runs it; returns true if it could not
+ // be written or run
+ bool emit(std::unique_ptr<llvm::LLVMContext> Ctx,
+           std::unique_ptr<llvm::Module> M);
+
 public:
- void compile(AST *Tree);
+ CodeGen(unsigned OptLevel = 0, bool TimePasses = false, bool Run = false)
+     : OptLevel(OptLevel), TimePasses(TimePasses), Run(Run), ExitCode(0),
+       PartitionSize(0), Threads(1), Output(Emitter::LL), OutputFile("-") {}
+
+ // writes the module as Type to File, "-" for the standard output
+ void setOutput(Emitter::FileType Type, llvm::StringRef File,
+                llvm::StringRef Runtime)
+ {
+   Output = Type;
+   OutputFile = File.str();
+   RuntimeLib = Runtime.str();
+ }
+
+ bool compile(AST *Tree);
+ bool compile(const FlatAST &Tree);
+
+ // the IR of Tree in Ctx as it is built, before any optimization
+ std::unique_ptr<llvm::Module> generate(AST *Tree, llvm::LLVMContext &Ctx);
+
+ // Emits the top-level statements in functions of Size statements each;
+ // objects and executables are then split by function into Threads parts,
+ // optimized and compiled in parallel
+ void setPartitioning(unsigned Size, unsigned NumThreads)
+ {
+   PartitionSize = Size;
+   Threads = NumThreads;
+ }
 
+ int getExitCode() const { return ExitCode; }
 };
-#endif
\ No newline at end of file
+#endif
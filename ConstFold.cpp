@@ -0,0 +1,378 @@
+#include "ConstFold.h"
+#include "ASTWalker.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Support/Casting.h"
+#include "llvm/Support/ErrorHandling.h"
+#include <algorithm>
+#include <cstdint>
+#include <iterator>
+#include <limits>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace {
+const int64_t MinValue = std::numeric_limits<int32_t>::min();
+const int64_t MaxValue = std::numeric_limits<int32_t>::max();
+
+// The values an i32 expression may have, Lo to Hi. Bounds are computed in
+// 64 bits, a result that may not fit in 32 bits may be anything.
+struct Range {
+  int64_t Lo, Hi;
+
+  static Range full() { return Range{MinValue, MaxValue}; }
+
+  static Range constant(int64_t Value) { return Range{Value, Value}; }
+
+  // Lo to Hi, or full() if they do not fit
+  static Range get(int64_t Lo, int64_t Hi) {
+    if (Lo < MinValue || Hi > MaxValue)
+      return full();
+    return Range{Lo, Hi};
+  }
+
+  bool isConstant() const { return Lo == Hi; }
+
+  bool contains(int64_t Value) const { return Lo <= Value && Value <= Hi; }
+
+  Range join(Range Other) const {
+    return Range{std::min(Lo, Other.Lo), std::max(Hi, Other.Hi)};
+  }
+};
+
+// The range of Op over L and R, for an Op that is monotonic in each
+// operand, so that the bounds are among the results for the bounds
+template <typename OpTy> Range corners(Range L, Range R, OpTy Op) {
+  int64_t Values[] = {Op(L.Lo, R.Lo), Op(L.Lo, R.Hi), Op(L.Hi, R.Lo),
+                      Op(L.Hi, R.Hi)};
+  return Range::get(*std::min_element(std::begin(Values), std::end(Values)),
+                    *std::max_element(std::begin(Values), std::end(Values)));
+}
+
+// |Base| ^ Exp for Exp >= 0, any value above 2^32 if it is larger
+uint64_t powerMagnitude(uint64_t Base, int64_t Exp) {
+  if (Base <= 1)
+    return Exp == 0 ? 1 : Base;
+  uint64_t Result = 1;
+  for (int64_t I = 0; I < Exp && Result <= (uint64_t(1) << 32); ++I)
+    Result *= Base;
+  return Result;
+}
+
+// Variables assigned or declared in a subtree
+class AssignedVars : public RecursiveASTWalker<AssignedVars> {
+public:
+  llvm::SmallVector<unsigned, 8> Symbols;
+
+  void visitEquation(Equation &Node) {
+    Symbols.push_back(Node.getLeft()->getSymbol());
+  }
+
+  void visitDeclaration(Declaration &Node) {
+    Symbols.append(Node.getSymbols().begin(), Node.getSymbols().end());
+  }
+};
+
+class Folder : public RecursiveASTWalker<Folder> {
+  ASTContext &Context;
+  DiagnosticsEngine &Diags;
+  std::vector<Range> Vars; // range of each variable, by symbol ID
+  // ranges of the variables the declarations in the open bodies shadow,
+  // innermost last, and the size of the log when each body was entered
+  std::vector<std::pair<unsigned, Range>> Shadowed;
+  llvm::SmallVector<size_t, 16> Bodies;
+  llvm::DenseMap<int64_t, Final *> Literals; // created for folded values
+  const char *Statement; // where the statement being folded starts
+  bool HasError;
+
+  Range getRange(unsigned Symbol) {
+    return Symbol < Vars.size() ? Vars[Symbol] : Range::full();
+  }
+
+  void setRange(unsigned Symbol, Range R) {
+    if (Symbol >= Vars.size())
+      Vars.resize(Symbol + 1, Range::full());
+    Vars[Symbol] = R;
+  }
+
+  // a variable may have any value either of the states may give it
+  static void join(std::vector<Range> &State, const std::vector<Range> &Other) {
+    if (Other.size() > State.size())
+      State.resize(Other.size(), Range::full());
+    for (size_t I = 0, E = State.size(); I != E; ++I)
+      State[I] = State[I].join(I < Other.size() ? Other[I] : Range::full());
+  }
+
+  Final *literal(int64_t Value) {
+    Final *&Literal = Literals[Value];
+    if (!Literal)
+      Literal = Context.getFinal(Final::num,
+                                 Context.save(std::to_string(Value)));
+    return Literal;
+  }
+
+  Range divide(BinaryOp::Operator Op, Range L, Range R, const char *Loc) {
+    if (R.isConstant() && R.Lo == 0) {
+      Diags.error(Loc, "Division by zero is not allowed.");
+      HasError = true;
+      return Range::full();
+    }
+    if (R.contains(0))
+      return Range::full();
+    if (Op == BinaryOp::slash)
+      return corners(L, R, [](int64_t A, int64_t B) { return A / B; });
+
+    // the remainder has the sign of the dividend and is smaller than the
+    // divisor; INT_MIN % -1 overflows like INT_MIN / -1
+    if (L.Lo == MinValue && R.contains(-1))
+      return Range::full();
+    if (L.isConstant() && R.isConstant())
+      return Range::constant(L.Lo % R.Lo);
+    int64_t Max = std::max(-R.Lo, R.Hi) - 1;
+    if (L.Lo >= 0)
+      return Range::get(0, std::min(L.Hi, Max));
+    if (L.Hi <= 0)
+      return Range::get(std::max(L.Lo, -Max), 0);
+    return Range::get(-Max, Max);
+  }
+
+  Range power(Range Base, Range Exp, const char *Loc) {
+    // what the runtime makes of a negative exponent is its business
+    if (Exp.Lo < 0)
+      return Range::full();
+    if (Base.isConstant() && Exp.isConstant()) {
+      uint64_t Magnitude =
+          powerMagnitude(Base.Lo < 0 ? -Base.Lo : Base.Lo, Exp.Lo);
+      bool Negative = Base.Lo < 0 && Exp.Lo % 2;
+      if (Magnitude > uint64_t(MaxValue) + Negative) {
+        Diags.warning(Loc, llvm::Twine(Base.Lo) + " ^ " + llvm::Twine(Exp.Lo) +
+                               " overflows 32 bits");
+        return Range::full();
+      }
+      return Range::constant(Negative ? -int64_t(Magnitude)
+                                      : int64_t(Magnitude));
+    }
+    // a base of magnitude 2 or more grows with the exponent, so the least
+    // magnitude is that of the least base to the least exponent
+    if (Exp.Lo >= 1 && (Base.Lo >= 2 || Base.Hi <= -2)) {
+      uint64_t Magnitude =
+          powerMagnitude(Base.Lo >= 2 ? Base.Lo : -Base.Hi, Exp.Lo);
+      if (Magnitude > uint64_t(MaxValue) + 1 ||
+          (Magnitude == uint64_t(MaxValue) + 1 && Base.Lo >= 2)) {
+        Diags.warning(Loc, "^ always overflows 32 bits");
+        return Range::full();
+      }
+    }
+    return Range::full();
+  }
+
+  // Loc is where the operation starts, for the messages
+  Range apply(BinaryOp::Operator Op, Range L, Range R, const char *Loc) {
+    switch (Op) {
+    case BinaryOp::Plus:
+      return Range::get(L.Lo + R.Lo, L.Hi + R.Hi);
+    case BinaryOp::Minus:
+      return Range::get(L.Lo - R.Hi, L.Hi - R.Lo);
+    case BinaryOp::star:
+      return corners(L, R, [](int64_t A, int64_t B) { return A * B; });
+    case BinaryOp::slash:
+    case BinaryOp::KW_mod:
+      return divide(Op, L, R, Loc);
+    case BinaryOp::power:
+      return power(L, R, Loc);
+    default:
+      // assignments never make it into an expression
+      return Range::full();
+    }
+  }
+
+  // Folds the comparisons of Cond; a condition is i1 in the IR, so it is
+  // never replaced by a literal itself
+  void foldCondition(Conditions *Cond) {
+    Range R;
+    fold(Cond, R);
+  }
+
+  // Computes the range of E and returns the expression to use in its
+  // place: a literal if E is a variable or arithmetic with a single
+  // possible value.
+  // Operands of a shared node are left alone, the node may stand for
+  // other values where else it is used.
+  // The nodes are folded in post-order on explicit stacks, as in
+  // Parser::parseBinaryExpr, so that any expression the parser accepts is
+  // folded without recursing once per level.
+  Expr *fold(Expr *E, Range &R) {
+    struct Pending {
+      Expr *E;
+      bool OperandsDone; // its operands are on top of Results
+    };
+    struct Result {
+      Expr *E;         // to use in place of the node
+      Range R;
+      const char *Loc; // where the node starts, i.e. its leftmost leaf
+    };
+    llvm::SmallVector<Pending, 16> Work;
+    llvm::SmallVector<Result, 16> Results;
+
+    Work.push_back(Pending{E, false});
+    while (!Work.empty()) {
+      Pending P = Work.pop_back_val();
+      switch (P.E->getNodeKind()) {
+      case AST::NK_Final: {
+        auto *F = llvm::cast<Final>(P.E);
+        Result Res{F, Range::full(), F->getLoc(Statement)};
+        int Value;
+        if (F->getKind() == Final::id) {
+          Res.R = getRange(F->getSymbol());
+          if (Res.R.isConstant())
+            Res.E = literal(Res.R.Lo);
+        } else if (!F->getVal().getAsInteger(10, Value)) {
+          Res.R = Range::constant(Value);
+        }
+        Results.push_back(Res);
+        continue;
+      }
+      case AST::NK_BinaryOp:
+      case AST::NK_Condition:
+      case AST::NK_Conditions:
+        break;
+      default:
+        llvm_unreachable("statement used as an expression");
+      }
+
+      // the left operand ends up on top of Work, it is folded first
+      if (!P.OperandsDone) {
+        Work.push_back(Pending{P.E, true});
+        if (auto *B = llvm::dyn_cast<BinaryOp>(P.E)) {
+          Work.push_back(Pending{B->getRight(), false});
+          Work.push_back(Pending{B->getLeft(), false});
+        } else if (auto *Cmp = llvm::dyn_cast<Condition>(P.E)) {
+          Work.push_back(Pending{Cmp->getRight(), false});
+          Work.push_back(Pending{Cmp->getLeft(), false});
+        } else {
+          auto *Cond = llvm::cast<Conditions>(P.E);
+          Work.push_back(Pending{Cond->getRight(), false});
+          Work.push_back(Pending{Cond->getLeft(), false});
+        }
+        continue;
+      }
+
+      Result Right = Results.pop_back_val();
+      Result &Left = Results.back();
+      if (auto *B = llvm::dyn_cast<BinaryOp>(P.E)) {
+        if (!B->isShared()) {
+          B->setLeft(Left.E);
+          B->setRight(Right.E);
+        }
+        Left.R = apply(B->getOperator(), Left.R, Right.R, Left.Loc);
+        Left.E = B;
+        if (Left.R.isConstant())
+          Left.E = literal(Left.R.Lo);
+        continue;
+      }
+      // the operands of and/or are conditions, which stay as they are
+      if (auto *Cmp = llvm::dyn_cast<Condition>(P.E)) {
+        Cmp->setLeft(Left.E);
+        Cmp->setRight(Right.E);
+      }
+      Left.E = P.E;
+      Left.R = Range{0, 1};
+    }
+    R = Results.back().R;
+    return Results.back().E;
+  }
+
+public:
+  Folder(ASTContext &Context, DiagnosticsEngine &Diags)
+      : Context(Context), Diags(Diags), Statement(nullptr), HasError(false) {}
+
+  bool hasError() { return HasError; }
+
+  // A declaration in a body shadows the variable outside, which keeps its
+  // symbol: the range the outer variable had at the declaration is logged
+  // and put back at the end of the body, so that what the inner variable
+  // holds never reaches a join or the statements after the body.
+  void walkBody(llvm::ArrayRef<Expr *> Body) {
+    Bodies.push_back(Shadowed.size());
+    for (Expr *Statement : Body)
+      walk(Statement);
+    for (size_t Begin = Bodies.pop_back_val(); Shadowed.size() > Begin;) {
+      setRange(Shadowed.back().first, Shadowed.back().second);
+      Shadowed.pop_back();
+    }
+  }
+
+  void walkEquation(Equation &Node) {
+    Statement = Node.getLoc();
+    Range R;
+    Node.setRight(fold(Node.getRight(), R));
+    setRange(Node.getLeft()->getSymbol(), R);
+  }
+
+  // A variable declared without an initializer holds garbage. The declared
+  // variables are in scope in their own initializer, as in Sema, DefUse and
+  // CodeGen, where they hold garbage too, so a shadowing declaration never
+  // folds its initializer with the value of the outer variable.
+  void walkDeclaration(Declaration &Node) {
+    for (unsigned Var : Node.getSymbols()) {
+      // the outermost scope is never left
+      if (!Bodies.empty())
+        Shadowed.emplace_back(Var, getRange(Var));
+      setRange(Var, Range::full());
+    }
+    Range R = Range::full();
+    Statement = Node.getLoc();
+    if (Node.getExpr())
+      Node.setExpr(fold(Node.getExpr(), R));
+    for (unsigned Var : Node.getSymbols())
+      setRange(Var, R);
+  }
+
+  // Every branch starts from the state before the statement, afterwards a
+  // variable may have any value one of them leaves it with
+  void walkIf(If &Node) {
+    std::vector<Range> Entry = Vars;
+    Statement = Node.getLoc();
+    foldCondition(Node.getCondition());
+    walkBody(Node.getBody());
+    std::vector<Range> Exit = std::move(Vars);
+    for (Elif *Branch : Node.getElifs()) {
+      Vars = Entry;
+      Statement = Branch->getLoc();
+      foldCondition(Branch->getCondition());
+      walkBody(Branch->getBody());
+      join(Exit, Vars);
+    }
+    Vars = Entry;
+    if (Node.getElse())
+      walkBody(Node.getElse()->getBody());
+    join(Exit, Vars);
+    Vars = std::move(Exit);
+  }
+
+  // The body may run any number of times, so the variables it assigns
+  // may have any value in the condition, the body and after the loop
+  void walkLoop(Loop &Node) {
+    AssignedVars Assigned;
+    for (Expr *Statement : Node.getBody())
+      Assigned.walk(Statement);
+    for (unsigned Var : Assigned.Symbols)
+      setRange(Var, Range::full());
+    std::vector<Range> Entry = Vars;
+    Statement = Node.getLoc();
+    foldCondition(Node.getCondition());
+    walkBody(Node.getBody());
+    Vars = std::move(Entry);
+  }
+};
+}
+
+bool ConstFold::fold(AST *Tree) {
+  if (!Tree)
+    return false;
+
+  Folder F(Context, Diags);
+  F.walk(Tree);
+  return F.hasError();
+}
@@ -0,0 +1,26 @@
+#ifndef CONSTFOLD_H
+#define CONSTFOLD_H
+
+#include "AST.h"
+#include "ASTContext.h"
+#include "Diagnostics.h"
+
+// ConstFold runs after Sema has accepted a tree and before CodeGen. It
+// follows the range of values every variable can hold through the
+// declarations, assignments and control flow, replaces every arithmetic
+// expression whose range is a single value by that literal, and reports
+// divisions and modulos by a value that is always zero and powers that
+// always overflow 32 bits.
+class ConstFold {
+  ASTContext &Context; // arena for the literals replacing folded expressions
+  DiagnosticsEngine &Diags;
+
+public:
+  ConstFold(ASTContext &Context, DiagnosticsEngine &Diags)
+      : Context(Context), Diags(Diags) {}
+
+  // folds Tree in place, returns true if an error was found
+  bool fold(AST *Tree);
+};
+
+#endif
@@ -0,0 +1,289 @@
+#include "DefUse.h"
+#include "ASTWalker.h"
+#include "ScopedSymbolTable.h"
+#include "llvm/ADT/BitVector.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Support/Casting.h"
+#include "llvm/Support/ErrorHandling.h"
+#include <vector>
+
+namespace {
+// A declared variable, the Index-th of Decl
+struct Variable {
+  Declaration *Decl;
+  unsigned Index;
+  bool Read;   // some expression reads it
+  bool Warned; // reported as maybe uninitialized already
+};
+
+// Variables are numbered in the order they are declared; the variables of
+// a declaration are numbered consecutively, from FirstVar[Decl]
+struct Variables {
+  std::vector<Variable> Vars;
+  llvm::DenseMap<Declaration *, unsigned> FirstVar;
+};
+
+// The forward pass: numbers the variables, resolves every use to the
+// variable in scope and tracks the variables assigned on every path to it
+class InitCheck : public RecursiveASTWalker<InitCheck> {
+  Variables &V;
+  DiagnosticsEngine &Diags;
+  ScopedSymbolTable<unsigned> Scope; // variable of each symbol in scope
+  llvm::BitVector Init;              // variables assigned on every path
+  const char *Statement; // where the statement being walked starts
+  unsigned NumWarnings;
+
+public:
+  InitCheck(Variables &V, DiagnosticsEngine &Diags)
+      : V(V), Diags(Diags), Statement(nullptr), NumWarnings(0) {}
+
+  unsigned getNumWarnings() { return NumWarnings; }
+
+  // Identifiers walked are reads, assignment targets are not walked; a
+  // read of a shared leaf is reported at its statement
+  void visitFinal(Final &Node) {
+    if (Node.getKind() != Final::id)
+      return;
+    unsigned Var = Scope.lookup(Node.getSymbol());
+    Variable &Info = V.Vars[Var];
+    Info.Read = true;
+    if (!Init.test(Var) && !Info.Warned) {
+      Diags.warning(Node.getLoc(Statement),
+                    "Variable " + Node.getVal() + " may be used uninitialized");
+      Info.Warned = true;
+      ++NumWarnings;
+    }
+  }
+
+  void walkEquation(Equation &Node) {
+    Statement = Node.getLoc();
+    walk(Node.getRight());
+    Init.set(Scope.lookup(Node.getLeft()->getSymbol()));
+  }
+
+  // As in Sema, the variables are in scope in their own initializer
+  void walkDeclaration(Declaration &Node) {
+    unsigned First = V.Vars.size();
+    V.FirstVar[&Node] = First;
+    llvm::ArrayRef<unsigned> Syms = Node.getSymbols();
+    for (unsigned I = 0, E = Syms.size(); I != E; ++I) {
+      V.Vars.push_back(Variable{&Node, I, false, false});
+      Scope.declare(Syms[I], First + I);
+    }
+    Init.resize(V.Vars.size());
+    if (!Node.getExpr())
+      return;
+    Statement = Node.getLoc();
+    walk(Node.getExpr());
+    Init.set(First, V.Vars.size());
+  }
+
+  void walkBody(llvm::ArrayRef<Expr *> Body) {
+    Scope.pushScope();
+    for (Expr *Statement : Body)
+      walk(Statement);
+    Scope.popScope();
+  }
+
+  // A variable is assigned after the statement if every branch assigns it,
+  // or the statement before if there is no else
+  void walkIf(If &Node) {
+    llvm::BitVector Entry = Init;
+    Statement = Node.getLoc();
+    walk(Node.getCondition());
+    walkBody(Node.getBody());
+    llvm::BitVector Exit = Init;
+    for (Elif *Branch : Node.getElifs()) {
+      Init = Entry;
+      Statement = Branch->getLoc();
+      walk(Branch->getCondition());
+      walkBody(Branch->getBody());
+      Exit &= Init;
+    }
+    Init = Entry;
+    if (Node.getElse())
+      walkBody(Node.getElse()->getBody());
+    Exit &= Init;
+    Init = std::move(Exit);
+  }
+
+  // The body only adds to the variables of the enclosing scopes that are
+  // assigned, so the first run of the body and of the condition sees the
+  // fewest, and none are left after a loop that does not run
+  void walkLoop(Loop &Node) {
+    llvm::BitVector Entry = Init;
+    Statement = Node.getLoc();
+    walk(Node.getCondition());
+    walkBody(Node.getBody());
+    Init = std::move(Entry);
+  }
+};
+
+// The backward pass: computes the variables live before each statement,
+// i.e. those it or a later statement may read before assigning them
+class Liveness {
+  Variables &V;
+  ScopedSymbolTable<unsigned> Scope;
+  // variables a loop may read before it assigns them, by the loop
+  llvm::DenseMap<Loop *, llvm::BitVector> LoopUses;
+  bool Mark; // mark dead stores, or only compute what is live
+
+  // the order the uses are found in does not matter, so the operands are
+  // simply pushed on a worklist
+  void addUses(Expr *E, llvm::BitVector &Live) {
+    llvm::SmallVector<Expr *, 16> Work{E};
+    while (!Work.empty()) {
+      Expr *Node = Work.pop_back_val();
+      switch (Node->getNodeKind()) {
+      case AST::NK_Final: {
+        auto *F = llvm::cast<Final>(Node);
+        if (F->getKind() == Final::id)
+          Live.set(Scope.lookup(F->getSymbol()));
+        break;
+      }
+      case AST::NK_BinaryOp:
+        Work.push_back(llvm::cast<BinaryOp>(Node)->getLeft());
+        Work.push_back(llvm::cast<BinaryOp>(Node)->getRight());
+        break;
+      case AST::NK_Condition:
+        Work.push_back(llvm::cast<Condition>(Node)->getLeft());
+        Work.push_back(llvm::cast<Condition>(Node)->getRight());
+        break;
+      case AST::NK_Conditions:
+        Work.push_back(llvm::cast<Conditions>(Node)->getLeft());
+        Work.push_back(llvm::cast<Conditions>(Node)->getRight());
+        break;
+      default:
+        llvm_unreachable("statement used as an expression");
+      }
+    }
+  }
+
+  // Walking backwards, the variables of a declaration go out of scope at
+  // the declaration; so the declarations of the body are all brought into
+  // scope first, each in a scope of its own, and left one by one
+  void body(llvm::ArrayRef<Expr *> Body, llvm::BitVector &Live) {
+    Scope.pushScope();
+    for (Expr *Statement : Body) {
+      auto *Decl = llvm::dyn_cast<Declaration>(Statement);
+      if (!Decl)
+        continue;
+      Scope.pushScope();
+      unsigned First = V.FirstVar.lookup(Decl);
+      llvm::ArrayRef<unsigned> Syms = Decl->getSymbols();
+      for (unsigned I = 0, E = Syms.size(); I != E; ++I)
+        Scope.declare(Syms[I], First + I);
+    }
+    for (Expr *Statement : llvm::reverse(Body)) {
+      statement(Statement, Live);
+      if (llvm::isa<Declaration>(Statement))
+        Scope.popScope();
+    }
+    Scope.popScope();
+  }
+
+  // The uses of a loop do not depend on what is live after it, they are
+  // computed once, without marking, and kept for enclosing loops
+  const llvm::BitVector &loopUses(Loop &Node) {
+    auto It = LoopUses.find(&Node);
+    if (It != LoopUses.end())
+      return It->second;
+    bool WasMarking = Mark;
+    Mark = false;
+    llvm::BitVector Uses(V.Vars.size());
+    body(Node.getBody(), Uses);
+    addUses(Node.getCondition(), Uses);
+    Mark = WasMarking;
+    return LoopUses[&Node] = std::move(Uses);
+  }
+
+  // Live holds the variables live after Statement, and those live before
+  // it on return
+  void statement(Expr *Statement, llvm::BitVector &Live) {
+    switch (Statement->getNodeKind()) {
+    case AST::NK_Equation: {
+      auto *Eq = llvm::cast<Equation>(Statement);
+      unsigned Var = Scope.lookup(Eq->getLeft()->getSymbol());
+      if (Mark)
+        Eq->setDeadStore(!Live.test(Var));
+      Live.reset(Var);
+      addUses(Eq->getRight(), Live);
+      return;
+    }
+    case AST::NK_Declaration: {
+      auto *Decl = llvm::cast<Declaration>(Statement);
+      unsigned First = V.FirstVar.lookup(Decl);
+      for (unsigned I = 0, E = Decl->getSymbols().size(); I != E; ++I) {
+        unsigned Var = First + I;
+        if (Mark) {
+          if (!V.Vars[Var].Read)
+            Decl->setVarUse(I, Declaration::UseNone);
+          else if (Decl->getExpr() && !Live.test(Var))
+            Decl->setVarUse(I, Declaration::UseDeadInit);
+          else
+            Decl->setVarUse(I, Declaration::UseRead);
+        }
+        Live.reset(Var);
+      }
+      if (Decl->getExpr())
+        addUses(Decl->getExpr(), Live);
+      return;
+    }
+    case AST::NK_If: {
+      // any branch may run, each after the conditions before it
+      auto *Node = llvm::cast<If>(Statement);
+      llvm::BitVector Out = Live;
+      body(Node->getBody(), Live);
+      addUses(Node->getCondition(), Live);
+      for (Elif *Branch : Node->getElifs()) {
+        llvm::BitVector In = Out;
+        body(Branch->getBody(), In);
+        addUses(Branch->getCondition(), In);
+        Live |= In;
+      }
+      if (Node->getElse())
+        body(Node->getElse()->getBody(), Out);
+      Live |= Out;
+      return;
+    }
+    case AST::NK_Loop: {
+      // Live before the condition is Live after the loop, plus what the
+      // condition and any run of the body read first: a variable the
+      // body assigns before reading it is not live around the loop
+      auto *Node = llvm::cast<Loop>(Statement);
+      Live |= loopUses(*Node);
+      if (Mark) {
+        llvm::BitVector In = Live;
+        body(Node->getBody(), In);
+      }
+      return;
+    }
+    default:
+      llvm_unreachable("expression used as a statement");
+    }
+  }
+
+public:
+  Liveness(Variables &V) : V(V), Mark(true) {}
+
+  // marks the dead stores of a program; nothing is live at its end
+  void run(GSM &Program) {
+    llvm::BitVector Live(V.Vars.size());
+    body(Program.getExprs(), Live);
+  }
+};
+}
+
+unsigned DefUse::analyze(AST *Tree) {
+  auto *Program = llvm::dyn_cast_or_null<GSM>(Tree);
+  if (!Program)
+    return 0;
+
+  Variables V;
+  InitCheck Check(V, Diags);
+  Check.walk(Program);
+  Liveness(V).run(*Program);
+  return Check.getNumWarnings();
+}
@@ -0,0 +1,28 @@
+#ifndef DEFUSE_H
+#define DEFUSE_H
+
+#include "AST.h"
+#include "Diagnostics.h"
+
+// DefUse runs after ConstFold on a tree Sema has accepted, and follows
+// every declared variable (a name declared again in an inner scope is
+// another variable) through the declarations, assignments and control
+// flow:
+//   - a forward pass warns about variables that may be read before they
+//     are assigned on some path;
+//   - a backward liveness pass marks the assignments and initializers
+//     whose value is never read (Equation::isDeadStore,
+//     Declaration::getVarUse) and the variables never read at all, so that
+//     CodeGen neither records those values nor computes unread
+//     initializers.
+class DefUse {
+  DiagnosticsEngine &Diags;
+
+public:
+  DefUse(DiagnosticsEngine &Diags) : Diags(Diags) {}
+
+  // analyses and marks Tree, returns the number of warnings
+  unsigned analyze(AST *Tree);
+};
+
+#endif
@@ -0,0 +1,87 @@
+#include "Diagnostics.h"
+#include "llvm/Support/JSON.h"
+#include <algorithm>
+#include <cstring>
+#include <utility>
+
+void DiagnosticsEngine::add(Diagnostic D)
+{
+    if (D.Sev == Warning)
+        ++NumWarnings;
+    if (D.Sev == Error && ++NumErrors > ErrorLimit && ErrorLimit)
+        return;
+    Pending.push_back(std::move(D));
+    if (Pending.back().Sev == Error && NumErrors == ErrorLimit)
+        Pending.push_back(Diagnostic{Note, NoLoc, "Too many errors, giving up"});
+}
+
+void DiagnosticsEngine::report(Severity Sev, const char *Loc,
+                               const llvm::Twine &Message)
+{
+    add(Diagnostic{Sev, getOffset(Loc), Message.str()});
+}
+
+void DiagnosticsEngine::print(llvm::raw_ostream &Out, const Diagnostic &D)
+{
+    static const char *const SeverityNames[] = {"note", "warning", "error"};
+
+    // the lines of a streamed input are not known
+    bool HasLine = D.Offset != NoLoc && !Locate;
+    unsigned Line = 0, Column = 0;
+    if (HasLine)
+    {
+        if (LineStarts.empty())
+        {
+            LineStarts.push_back(0);
+            for (const char *P = Source.begin(), *E = Source.end();
+                 (P = static_cast<const char *>(std::memchr(P, '\n', E - P)));)
+                LineStarts.push_back(++P - Source.begin());
+        }
+        auto Next = std::upper_bound(LineStarts.begin(), LineStarts.end(),
+                                     D.Offset);
+        Line = Next - LineStarts.begin();
+        Column = D.Offset - Next[-1] + 1;
+    }
+
+    if (Format == JSON)
+    {
+        llvm::json::OStream J(Out);
+        J.object([&] {
+            J.attribute("severity", SeverityNames[D.Sev]);
+            if (!FileName.empty())
+                J.attribute("file", FileName);
+            if (D.Offset != NoLoc)
+                J.attribute("offset", int64_t(D.Offset));
+            if (HasLine)
+            {
+                J.attribute("line", int64_t(Line));
+                J.attribute("column", int64_t(Column));
+            }
+            J.attribute("message", D.Message);
+        });
+        Out << '\n';
+        return;
+    }
+
+    if (!FileName.empty())
+        Out << FileName << ':';
+    if (HasLine)
+        Out << Line << ':' << Column << ':';
+    if (!FileName.empty() || HasLine)
+        Out << ' ';
+    Out << SeverityNames[D.Sev] << ": " << D.Message << '\n';
+}
+
+void DiagnosticsEngine::flush()
+{
+    if (Pending.empty())
+        return;
+    std::string Buffer;
+    llvm::raw_string_ostream Out(Buffer);
+    for (const Diagnostic &D : Pending)
+        print(Out, D);
+    Out.flush();
+    OS << Buffer;
+    OS.flush();
+    Pending.clear();
+}
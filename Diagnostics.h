@@ -0,0 +1,152 @@
+#ifndef DIAGNOSTICS_H
+#define DIAGNOSTICS_H
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ADT/Twine.h"
+#include "llvm/Support/raw_ostream.h"
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+// DiagnosticsEngine collects the errors and warnings of a compilation and
+// prints them in batches, so an input with many errors costs one write per
+// phase rather than one per message.
+//
+// A message is located by a pointer into the source buffer, e.g. the text
+// of a token or of an identifier in the AST, and only its byte offset is
+// kept; offsets are turned into line and column when the messages are
+// printed, through a table of line starts built the first time one is
+// needed. A streamed input is not in one buffer: its locations are turned
+// into offsets by a function the lexer provides, and have no line and
+// column. Any other text that is not in the source buffer (a loaded
+// .gsmast file, a folded literal) has no location.
+//
+// Messages are printed as "file:line:column: error: message", or as one
+// JSON object per line for tools.
+class DiagnosticsEngine
+{
+public:
+    enum Severity : unsigned char
+    {
+        Note,
+        Warning,
+        Error
+    };
+
+    enum OutputFormat
+    {
+        Text,
+        JSON
+    };
+
+    // offset of a message without a location
+    static constexpr uint32_t NoLoc = ~uint32_t(0);
+
+    // a message as it is kept until printed
+    struct Diagnostic
+    {
+        Severity Sev;
+        uint32_t Offset; // in the source buffer, or NoLoc
+        std::string Message;
+    };
+
+private:
+
+    llvm::raw_ostream &OS;
+    OutputFormat Format;
+    std::string FileName;
+    llvm::StringRef Source;           // the buffer locations point into
+    // offset of a location of a streamed input, in place of Source
+    std::function<uint64_t(const char *)> Locate;
+    std::vector<uint32_t> LineStarts; // offset of each line, built lazily
+    std::vector<Diagnostic> Pending;  // reported but not printed yet
+    unsigned NumErrors;
+    unsigned NumWarnings;
+    unsigned ErrorLimit; // errors after this many are dropped, 0 for none
+
+    uint32_t getOffset(const char *Loc) const
+    {
+        if (Loc && Locate)
+            return std::min<uint64_t>(Locate(Loc), NoLoc);
+        if (!Loc || Loc < Source.begin() || Loc > Source.end())
+            return NoLoc;
+        return Loc - Source.begin();
+    }
+
+    void add(Diagnostic D);
+
+    void print(llvm::raw_ostream &Out, const Diagnostic &D);
+
+public:
+    DiagnosticsEngine(llvm::raw_ostream &OS, OutputFormat Format = Text)
+        : OS(OS), Format(Format), NumErrors(0), NumWarnings(0), ErrorLimit(0)
+    {
+    }
+
+    ~DiagnosticsEngine() { flush(); }
+
+    DiagnosticsEngine(const DiagnosticsEngine &) = delete;
+    DiagnosticsEngine &operator=(const DiagnosticsEngine &) = delete;
+
+    // names the input and the buffer holding it; the locations of messages
+    // reported later are taken relative to Buffer
+    void setSource(llvm::StringRef Name, llvm::StringRef Buffer)
+    {
+        FileName = Name.str();
+        Source = Buffer;
+        Locate = nullptr;
+        LineStarts.clear();
+    }
+
+    // names a streamed input and the function giving the offsets of its
+    // locations, ~0 for none
+    void setStreamedSource(llvm::StringRef Name,
+                           std::function<uint64_t(const char *)> Offset)
+    {
+        setSource(Name, llvm::StringRef());
+        Locate = std::move(Offset);
+    }
+
+    OutputFormat getFormat() const { return Format; }
+
+    // after Limit errors the rest are dropped, 0 means no limit
+    void setErrorLimit(unsigned Limit) { ErrorLimit = Limit; }
+
+    bool hasReachedErrorLimit() const
+    {
+        return ErrorLimit && NumErrors >= ErrorLimit;
+    }
+
+    // reports Message at Loc, a pointer into the source or nullptr
+    void report(Severity Sev, const char *Loc, const llvm::Twine &Message);
+
+    // reports a message kept from an earlier compilation of the same source
+    void report(const Diagnostic &D) { add(D); }
+
+    void error(const char *Loc, const llvm::Twine &Message)
+    {
+        report(Error, Loc, Message);
+    }
+
+    void warning(const char *Loc, const llvm::Twine &Message)
+    {
+        report(Warning, Loc, Message);
+    }
+
+    bool hasErrors() const { return NumErrors != 0; }
+
+    unsigned getNumErrors() const { return NumErrors; }
+
+    unsigned getNumWarnings() const { return NumWarnings; }
+
+    // the messages reported since the last flush
+    llvm::ArrayRef<Diagnostic> getPending() const { return Pending; }
+
+    // prints the messages reported since the last flush in one write
+    void flush();
+};
+
+#endif
@@ -0,0 +1,316 @@
+#include "Emitter.h"
+#include "llvm/ADT/ScopeExit.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/Module.h"
+#include "llvm/MC/TargetRegistry.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/FileUtilities.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Program.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/ToolOutputFile.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Target/TargetOptions.h"
+#include "llvm/Transforms/Utils/SplitModule.h"
+#include <algorithm>
+
+using namespace llvm;
+
+Emitter::Emitter(FileType Type, StringRef OutputFile, StringRef RuntimeLib,
+                 raw_ostream &Err)
+    : Type(Type), OutputFile(OutputFile), RuntimeLib(RuntimeLib), Err(Err),
+      OptLevel(0)
+{
+    // an executable is not written to the standard output
+    if (Type == Exe && this->OutputFile == "-")
+        this->OutputFile = "a.out";
+}
+
+Emitter::~Emitter() = default;
+
+// A TargetMachine for the host; they are not shared between threads.
+std::unique_ptr<TargetMachine> Emitter::createTargetMachine()
+{
+    std::string Triple = sys::getDefaultTargetTriple();
+    std::string Error;
+    const Target *T = TargetRegistry::lookupTarget(Triple, Error);
+    if (!T)
+    {
+        Err << "gsm: " << Error << '\n';
+        return nullptr;
+    }
+
+    // position independent, so the default PIE link of the host works
+    static const CodeGenOpt::Level Levels[] = {
+        CodeGenOpt::None, CodeGenOpt::Less, CodeGenOpt::Default,
+        CodeGenOpt::Aggressive};
+    return std::unique_ptr<TargetMachine>(T->createTargetMachine(
+        Triple, "generic", "", TargetOptions(), Reloc::PIC_, None,
+        Levels[std::min(OptLevel, 3u)]));
+}
+
+bool Emitter::prepare(Module &M, unsigned OptLevel)
+{
+    if (Type == LL || Type == BC)
+        return false;
+
+    InitializeNativeTarget();
+    InitializeNativeTargetAsmPrinter();
+    this->OptLevel = OptLevel;
+    TM = createTargetMachine();
+    if (!TM)
+        return true;
+    M.setTargetTriple(TM->getTargetTriple().str());
+    M.setDataLayout(TM->createDataLayout());
+    return false;
+}
+
+bool Emitter::writeNative(Module &M, StringRef File, bool Assembly)
+{
+    std::error_code EC;
+    ToolOutputFile Out(File, EC,
+                       Assembly ? sys::fs::OF_Text : sys::fs::OF_None);
+    if (EC)
+    {
+        Err << "gsm: cannot open " << File << ": " << EC.message() << '\n';
+        return true;
+    }
+    // The object writer seeks back to patch its headers, which a pipe
+    // cannot do; it writes to a buffer then, flushed when it goes away.
+    std::unique_ptr<buffer_ostream> Buffer;
+    raw_pwrite_stream *OS = &Out.os();
+    if (!Out.os().supportsSeeking())
+    {
+        Buffer = std::make_unique<buffer_ostream>(Out.os());
+        OS = Buffer.get();
+    }
+    legacy::PassManager PM;
+    if (TM->addPassesToEmitFile(PM, *OS, nullptr,
+                                Assembly ? CGFT_AssemblyFile
+                                         : CGFT_ObjectFile))
+    {
+        Err << "gsm: the target cannot emit this file type\n";
+        return true;
+    }
+    PM.run(M);
+    Buffer.reset();
+    Out.keep();
+    return false;
+}
+
+// Links with the C compiler driver, which knows the startup files and the
+// C library the runtime needs.
+bool Emitter::link(ArrayRef<std::string> Objects, StringRef Output,
+                   bool Relocatable)
+{
+    ErrorOr<std::string> CC = sys::findProgramByName("cc");
+    if (!CC)
+    {
+        Err << "gsm: cannot find cc to link " << Output << '\n';
+        return true;
+    }
+    SmallVector<StringRef, 16> Args{*CC};
+    if (Relocatable)
+        Args.append({"-r", "-nostdlib"});
+    Args.append(Objects.begin(), Objects.end());
+    if (!Relocatable)
+    {
+        if (!sys::fs::exists(RuntimeLib))
+        {
+            Err << "gsm: cannot find the runtime " << RuntimeLib << '\n';
+            return true;
+        }
+        Args.push_back(RuntimeLib);
+    }
+    Args.append({"-o", Output});
+    std::string Message;
+    if (sys::ExecuteAndWait(*CC, Args, None, {}, 0, 0, &Message))
+    {
+        Err << "gsm: linking " << Output << " failed";
+        if (!Message.empty())
+            Err << ": " << Message;
+        Err << '\n';
+        return true;
+    }
+    return false;
+}
+
+bool Emitter::write(Module &M)
+{
+    switch (Type)
+    {
+    case LL:
+    case BC:
+    {
+        std::error_code EC;
+        ToolOutputFile Out(OutputFile, EC,
+                           Type == LL ? sys::fs::OF_Text : sys::fs::OF_None);
+        if (EC)
+        {
+            Err << "gsm: cannot open " << OutputFile << ": " << EC.message()
+                << '\n';
+            return true;
+        }
+        if (Type == LL)
+            M.print(Out.os(), nullptr);
+        else
+            WriteBitcodeToFile(M, Out.os());
+        Out.keep();
+        return false;
+    }
+    case Asm:
+    case Obj:
+        return writeNative(M, OutputFile, Type == Asm);
+    case Exe:
+    {
+        SmallString<128> Object;
+        if (std::error_code EC =
+                sys::fs::createTemporaryFile("gsm", "o", Object))
+        {
+            Err << "gsm: cannot create an object file: " << EC.message()
+                << '\n';
+            return true;
+        }
+        FileRemover RemoveObject(Object);
+        return writeNative(M, Object, false) ||
+               link(std::string(Object.str()), OutputFile, false);
+    }
+    }
+    llvm_unreachable("unknown file type");
+}
+
+bool Emitter::writeSplit(
+    Module &M, unsigned NumParts,
+    std::function<void(Module &, TargetMachine *)> Optimize)
+{
+    // A context must not be used by two threads, so each part is handed
+    // over as bitcode and read back into a context of the thread. The
+    // functions and globals a part refers to in another are made external.
+    std::vector<SmallString<0>> Bitcode;
+    SplitModule(M, NumParts, [&](std::unique_ptr<Module> Part) {
+        // with fewer functions than parts, some parts define nothing
+        if (all_of(Part->global_values(),
+                   [](GlobalValue &GV) { return GV.isDeclaration(); }))
+            return;
+        Bitcode.emplace_back();
+        raw_svector_ostream OS(Bitcode.back());
+        WriteBitcodeToFile(*Part, OS);
+    });
+
+    std::vector<SmallString<0>> Objects(Bitcode.size());
+    std::vector<std::string> Errors(Bitcode.size());
+    {
+        ThreadPool Pool(heavyweight_hardware_concurrency(Bitcode.size()));
+        for (unsigned I = 0, E = Bitcode.size(); I != E; ++I)
+            Pool.async([&, I] {
+                LLVMContext Ctx;
+                Expected<std::unique_ptr<Module>> Part = parseBitcodeFile(
+                    MemoryBufferRef(Bitcode[I], "gsm.part"), Ctx);
+                if (!Part)
+                {
+                    Errors[I] = toString(Part.takeError());
+                    return;
+                }
+                std::unique_ptr<TargetMachine> PartTM = createTargetMachine();
+                Optimize(**Part, PartTM.get());
+                raw_svector_ostream OS(Objects[I]);
+                legacy::PassManager PM;
+                if (PartTM->addPassesToEmitFile(PM, OS, nullptr,
+                                                CGFT_ObjectFile))
+                {
+                    Errors[I] = "the target cannot emit object files";
+                    return;
+                }
+                PM.run(**Part);
+            });
+        Pool.wait();
+    }
+    for (const std::string &Error : Errors)
+        if (!Error.empty())
+        {
+            Err << "gsm: " << Error << '\n';
+            return true;
+        }
+
+    // One object file is written as it is, more are linked into the output
+    if (Type == Obj && Objects.size() == 1)
+    {
+        std::error_code EC;
+        ToolOutputFile Out(OutputFile, EC, sys::fs::OF_None);
+        if (EC)
+        {
+            Err << "gsm: cannot open " << OutputFile << ": " << EC.message()
+                << '\n';
+            return true;
+        }
+        Out.os() << Objects[0];
+        Out.keep();
+        return false;
+    }
+    std::vector<std::string> Files;
+    auto RemoveFiles = make_scope_exit([&] {
+        for (const std::string &File : Files)
+            sys::fs::remove(File);
+    });
+    for (SmallString<0> &Object : Objects)
+    {
+        SmallString<128> File;
+        if (std::error_code EC = sys::fs::createTemporaryFile("gsm", "o", File))
+        {
+            Err << "gsm: cannot create an object file: " << EC.message()
+                << '\n';
+            return true;
+        }
+        Files.push_back(std::string(File.str()));
+        std::error_code EC;
+        raw_fd_ostream OS(File, EC, sys::fs::OF_None);
+        if (!EC)
+            OS << Object;
+        if (EC || OS.has_error())
+        {
+            Err << "gsm: cannot write " << File << '\n';
+            return true;
+        }
+    }
+    if (OutputFile != "-")
+        return link(Files, OutputFile, Type == Obj);
+
+    // cc cannot link to the standard output, so the object file is linked
+    // next to the parts and copied there
+    SmallString<128> Linked;
+    if (std::error_code EC = sys::fs::createTemporaryFile("gsm", "o", Linked))
+    {
+        Err << "gsm: cannot create an object file: " << EC.message() << '\n';
+        return true;
+    }
+    Files.push_back(std::string(Linked.str()));
+    if (link(makeArrayRef(Files).drop_back(), Linked, true))
+        return true;
+    ErrorOr<std::unique_ptr<MemoryBuffer>> Object =
+        MemoryBuffer::getFile(Linked, /*IsText=*/false,
+                              /*RequiresNullTerminator=*/false);
+    if (!Object)
+    {
+        Err << "gsm: cannot read " << Linked << ": "
+            << Object.getError().message() << '\n';
+        return true;
+    }
+    std::error_code EC;
+    ToolOutputFile Out(OutputFile, EC, sys::fs::OF_None);
+    if (EC)
+    {
+        Err << "gsm: cannot open " << OutputFile << ": " << EC.message()
+            << '\n';
+        return true;
+    }
+    Out.os() << (*Object)->getBuffer();
+    Out.keep();
+    return false;
+}
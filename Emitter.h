@@ -0,0 +1,79 @@
+#ifndef EMITTER_H
+#define EMITTER_H
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/raw_ostream.h"
+#include <functional>
+#include <memory>
+#include <string>
+
+namespace llvm
+{
+  class Module;
+  class TargetMachine;
+}
+
+// Emitter writes a module to a file in the form the driver asks for:
+// textual IR or bitcode straight from the module, assembly or an object
+// file through the TargetMachine of the host, or an executable linked from
+// that object file and the static runtime (libgsmrt.a, built from
+// Runtime.cpp). Nothing goes through textual IR and llc on the way.
+//
+// Object files and executables can also be produced in parts: the module
+// is split by function, and every part is optimized and compiled on a
+// thread of its own, in a context of its own, before they are linked.
+class Emitter
+{
+public:
+    enum FileType
+    {
+        LL,  // textual IR
+        BC,  // bitcode
+        Asm, // assembly
+        Obj, // object file
+        Exe  // executable
+    };
+
+private:
+    FileType Type;
+    std::string OutputFile;            // "-" for the standard output
+    std::string RuntimeLib;            // archive an executable links with
+    llvm::raw_ostream &Err;
+    std::unique_ptr<llvm::TargetMachine> TM; // none for IR and bitcode
+    unsigned OptLevel;
+
+    std::unique_ptr<llvm::TargetMachine> createTargetMachine();
+    bool writeNative(llvm::Module &M, llvm::StringRef File, bool Assembly);
+    // links Objects into Output, an executable or, if Relocatable, an
+    // object file
+    bool link(llvm::ArrayRef<std::string> Objects, llvm::StringRef Output,
+              bool Relocatable);
+
+public:
+    Emitter(FileType Type, llvm::StringRef OutputFile,
+            llvm::StringRef RuntimeLib, llvm::raw_ostream &Err);
+    ~Emitter();
+
+    // Creates the TargetMachine for assembly, object files and executables
+    // and gives M its triple and data layout, so the optimizer sees the
+    // target; returns true on error
+    bool prepare(llvm::Module &M, unsigned OptLevel);
+
+    llvm::TargetMachine *getTargetMachine() const { return TM.get(); }
+
+    // writes M to the output file, returns true on error
+    bool write(llvm::Module &M);
+
+    // whether writeSplit can produce Type
+    static bool canSplit(FileType Type) { return Type == Obj || Type == Exe; }
+
+    // Writes M in up to NumParts parts, run through Optimize and compiled
+    // on as many threads; Optimize is called on several threads at once.
+    // Returns true on error
+    bool writeSplit(
+        llvm::Module &M, unsigned NumParts,
+        std::function<void(llvm::Module &, llvm::TargetMachine *)> Optimize);
+};
+
+#endif
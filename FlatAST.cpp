@@ -0,0 +1,652 @@
+#include "FlatAST.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Support/Casting.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Support/xxhash.h"
+#include <algorithm>
+#include <cstring>
+#include <iterator>
+
+void FlatAST::reserve(unsigned NumNodes)
+{
+    KindStore.reserve(NumNodes);
+    OpStore.reserve(NumNodes);
+    OffsetStore.reserve(NumNodes + 1);
+    // every node but the root is referred to by its parent
+    ChildStore.reserve(NumNodes);
+    updateArrays();
+}
+
+namespace
+{
+    template <typename T>
+    void shrink(llvm::SmallVector<T, 0> &Array)
+    {
+        llvm::SmallVector<T, 0> Exact;
+        Exact.reserve(Array.size());
+        Exact.append(Array.begin(), Array.end());
+        Array.swap(Exact);
+    }
+}
+
+void FlatAST::shrinkToFit()
+{
+    shrink(KindStore);
+    shrink(OpStore);
+    shrink(OffsetStore);
+    shrink(ChildStore);
+    shrink(Names);
+    shrink(Payloads);
+    llvm::DenseMap<llvm::StringRef, uint32_t>().swap(PayloadIndex);
+    updateArrays();
+}
+
+FlatAST::NodeRef FlatAST::addLeaf(NodeKind Kind, llvm::StringRef Text)
+{
+    assert(Kind == Num && "only literals have a payload");
+    assert(!File && "a loaded tree cannot be changed");
+    auto Inserted = PayloadIndex.try_emplace(Text, Payloads.size());
+    if (Inserted.second)
+        Payloads.push_back(Text);
+    KindStore.push_back(Kind);
+    OpStore.push_back(0);
+    ChildStore.push_back(Inserted.first->second);
+    OffsetStore.push_back(ChildStore.size());
+    updateArrays();
+    return Kinds.size() - 1;
+}
+
+FlatAST::NodeRef FlatAST::addSymbol(NodeKind Kind, unsigned Symbol,
+                                    llvm::StringRef Name, unsigned Op)
+{
+    assert(isSymbol(Kind) && "only identifiers have a symbol");
+    assert(!File && "a loaded tree cannot be changed");
+    if (Symbol >= Names.size())
+        Names.resize(Symbol + 1);
+    Names[Symbol] = Name;
+    KindStore.push_back(Kind);
+    OpStore.push_back(Op);
+    ChildStore.push_back(Symbol);
+    OffsetStore.push_back(ChildStore.size());
+    updateArrays();
+    return Kinds.size() - 1;
+}
+
+FlatAST::NodeRef FlatAST::addNode(NodeKind Kind, unsigned Op,
+                                  llvm::ArrayRef<NodeRef> Kids)
+{
+    assert(!isLeaf(Kind) && "leaf added as an inner node");
+    assert(!File && "a loaded tree cannot be changed");
+    KindStore.push_back(Kind);
+    OpStore.push_back(Op);
+    ChildStore.append(Kids.begin(), Kids.end());
+    OffsetStore.push_back(ChildStore.size());
+    updateArrays();
+    return Kinds.size() - 1;
+}
+
+namespace
+{
+    // appends the nodes of a pointer tree to a FlatAST in post-order;
+    // visiting a node leaves its index in Last
+    class FlatBuilder : public ASTVisitor
+    {
+        FlatAST &Flat;
+        FlatAST::NodeRef Last;
+
+        FlatAST::NodeRef add(AST *Node)
+        {
+            Node->accept(*this);
+            return Last;
+        }
+
+        FlatAST::NodeRef addBlock(llvm::ArrayRef<Expr *> Body)
+        {
+            llvm::SmallVector<FlatAST::NodeRef, 8> Kids;
+            for (Expr *Statement : Body)
+                Kids.push_back(add(Statement));
+            return Flat.addNode(FlatAST::Block, 0, Kids);
+        }
+
+        // operators and comparisons nest as deep as the parser accepts, so
+        // they are added in post-order on explicit stacks, not recursively
+        FlatAST::NodeRef addExpr(Expr *E)
+        {
+            struct Pending
+            {
+                Expr *E;
+                bool OperandsDone; // their indices are on top of Operands
+            };
+            llvm::SmallVector<Pending, 16> Work{{E, false}};
+            llvm::SmallVector<FlatAST::NodeRef, 16> Operands;
+            while (!Work.empty())
+            {
+                Pending P = Work.pop_back_val();
+                FlatAST::NodeKind Kind;
+                unsigned Op;
+                Expr *Left, *Right;
+                if (auto *B = llvm::dyn_cast<BinaryOp>(P.E))
+                {
+                    Kind = FlatAST::BinaryOp;
+                    Op = B->getOperator();
+                    Left = B->getLeft();
+                    Right = B->getRight();
+                }
+                else if (auto *Cmp = llvm::dyn_cast<Condition>(P.E))
+                {
+                    Kind = FlatAST::Condition;
+                    Op = Cmp->getOperator();
+                    Left = Cmp->getLeft();
+                    Right = Cmp->getRight();
+                }
+                else if (auto *Cond = llvm::dyn_cast<Conditions>(P.E))
+                {
+                    Kind = FlatAST::Conditions;
+                    Op = Cond->getAO();
+                    Left = Cond->getLeft();
+                    Right = Cond->getRight();
+                }
+                else
+                {
+                    Operands.push_back(add(P.E));
+                    continue;
+                }
+
+                if (!P.OperandsDone)
+                {
+                    Work.push_back({P.E, true});
+                    Work.push_back({Right, false});
+                    Work.push_back({Left, false});
+                    continue;
+                }
+                FlatAST::NodeRef RightRef = Operands.pop_back_val();
+                FlatAST::NodeRef LeftRef = Operands.pop_back_val();
+                Operands.push_back(Flat.addNode(Kind, Op, {LeftRef, RightRef}));
+            }
+            return Operands.back();
+        }
+
+    public:
+        FlatBuilder(FlatAST &Flat) : Flat(Flat), Last(0) {}
+
+        virtual void visit(GSM &Node) override
+        {
+            llvm::SmallVector<FlatAST::NodeRef, 64> Kids;
+            for (Expr *Statement : Node)
+                Kids.push_back(add(Statement));
+            Last = Flat.addNode(FlatAST::Program, 0, Kids);
+        }
+
+        virtual void visit(Final &Node) override
+        {
+            if (Node.getKind() == Final::id)
+                Last = Flat.addSymbol(FlatAST::Id, Node.getSymbol(),
+                                      Node.getVal());
+            else
+                Last = Flat.addLeaf(FlatAST::Num, Node.getVal());
+        }
+
+        virtual void visit(BinaryOp &Node) override { Last = addExpr(&Node); }
+
+        virtual void visit(Equation &Node) override
+        {
+            FlatAST::NodeRef Target = add(Node.getLeft());
+            FlatAST::NodeRef Value = add(Node.getRight());
+            Last = Flat.addNode(FlatAST::Equation, Node.isDeadStore(),
+                                {Target, Value});
+        }
+
+        virtual void visit(Declaration &Node) override
+        {
+            llvm::SmallVector<FlatAST::NodeRef, 8> Kids;
+            llvm::ArrayRef<unsigned> Syms = Node.getSymbols();
+            for (unsigned I = 0, E = Syms.size(); I != E; ++I)
+                Kids.push_back(Flat.addSymbol(FlatAST::VarDecl, Syms[I],
+                                              Node.getVars()[I],
+                                              Node.getVarUse(I)));
+            if (Node.getExpr())
+                Kids.push_back(add(Node.getExpr()));
+            Last = Flat.addNode(FlatAST::Declaration,
+                                Node.getExpr() != nullptr, Kids);
+        }
+
+        virtual void visit(Conditions &Node) override { Last = addExpr(&Node); }
+
+        virtual void visit(Condition &Node) override { Last = addExpr(&Node); }
+
+        virtual void visit(If &Node) override
+        {
+            llvm::SmallVector<FlatAST::NodeRef, 8> Kids;
+            Kids.push_back(add(Node.getCondition()));
+            Kids.push_back(addBlock(Node.getBody()));
+            for (Elif *Branch : Node.getElifs())
+                Kids.push_back(add(Branch));
+            if (Node.getElse())
+                Kids.push_back(add(Node.getElse()));
+            Last = Flat.addNode(FlatAST::If, 0, Kids);
+        }
+
+        virtual void visit(Elif &Node) override
+        {
+            FlatAST::NodeRef Cond = add(Node.getCondition());
+            FlatAST::NodeRef Body = addBlock(Node.getBody());
+            Last = Flat.addNode(FlatAST::Elif, 0, {Cond, Body});
+        }
+
+        virtual void visit(Else &Node) override
+        {
+            FlatAST::NodeRef Body = addBlock(Node.getBody());
+            Last = Flat.addNode(FlatAST::Else, 0, {Body});
+        }
+
+        virtual void visit(Loop &Node) override
+        {
+            FlatAST::NodeRef Cond = add(Node.getCondition());
+            FlatAST::NodeRef Body = addBlock(Node.getBody());
+            Last = Flat.addNode(FlatAST::Loop, 0, {Cond, Body});
+        }
+    };
+}
+
+namespace
+{
+    // an i32 value: arithmetic, a literal or a variable
+    bool isValue(FlatAST::NodeKind Kind)
+    {
+        return Kind == FlatAST::BinaryOp || Kind == FlatAST::Num ||
+               Kind == FlatAST::Id;
+    }
+
+    // an i1 value: a comparison, or comparisons joined by and/or
+    bool isTest(FlatAST::NodeKind Kind)
+    {
+        return Kind == FlatAST::Condition || Kind == FlatAST::Conditions;
+    }
+
+    bool isStatement(FlatAST::NodeKind Kind)
+    {
+        return Kind == FlatAST::Declaration || Kind == FlatAST::Equation ||
+               Kind == FlatAST::If || Kind == FlatAST::Loop;
+    }
+}
+
+// One pass in post-order. Besides the kinds, ops and counts of each node,
+// the subtree of every node must be the range of nodes just before it,
+// its children's subtrees one after the other, as emitExpr and Sema walk
+// such ranges; First holds where each subtree starts.
+bool FlatAST::isWellFormed() const
+{
+    if (empty() || Offsets.size() != size() + 1 || Offsets.front() != 0 ||
+        Offsets.back() != Children.size())
+        return false;
+    std::vector<NodeRef> First(size());
+    for (NodeRef N = 0, E = size(); N != E; ++N)
+    {
+        NodeKind Kind = Kinds[N];
+        unsigned Op = Ops[N];
+        if (Kind > VarDecl || Offsets[N] > Offsets[N + 1] ||
+            Offsets[N + 1] > Children.size())
+            return false;
+        llvm::ArrayRef<uint32_t> Kids(Children.data() + Offsets[N],
+                                      Children.data() + Offsets[N + 1]);
+        if (isLeaf(Kind))
+        {
+            if (Kids.size() != 1)
+                return false;
+            First[N] = N;
+            switch (Kind)
+            {
+            case Num:
+                if (Op != 0 || Kids[0] >= Payloads.size())
+                    return false;
+                break;
+            case Id:
+                if (Op != 0 || Kids[0] >= Names.size())
+                    return false;
+                break;
+            default:
+                if (Op > ::Declaration::UseNone || Kids[0] >= Names.size())
+                    return false;
+                break;
+            }
+            continue;
+        }
+
+        // the children tile the range just before N
+        NodeRef Next = N;
+        for (unsigned I = Kids.size(); I != 0; --I)
+        {
+            if (Next == 0 || Kids[I - 1] != Next - 1)
+                return false;
+            Next = First[Kids[I - 1]];
+        }
+        First[N] = Next;
+
+        auto kindIs = [&](unsigned I, bool (*Test)(NodeKind)) {
+            return Test(Kinds[Kids[I]]);
+        };
+        auto allAre = [&](unsigned Begin, unsigned End,
+                          bool (*Test)(NodeKind)) {
+            for (unsigned I = Begin; I != End; ++I)
+                if (!kindIs(I, Test))
+                    return false;
+            return true;
+        };
+        auto isBlock = [](NodeKind K) { return K == Block; };
+        auto isElif = [](NodeKind K) { return K == Elif; };
+        auto isElse = [](NodeKind K) { return K == Else; };
+        unsigned Size = Kids.size();
+        bool Fits;
+        switch (Kind)
+        {
+        case Program:
+            Fits = Op == 0 && N == E - 1 && Next == 0 &&
+                   allAre(0, Size, isStatement);
+            break;
+        case Block:
+            Fits = Op == 0 && allAre(0, Size, isStatement);
+            break;
+        case Declaration:
+            Fits = Op <= 1 && Size > Op &&
+                   allAre(0, Size - Op,
+                          [](NodeKind K) { return K == VarDecl; }) &&
+                   allAre(Size - Op, Size, isValue);
+            break;
+        case Equation:
+            Fits = Op <= 1 && Size == 2 && Kinds[Kids[0]] == Id &&
+                   kindIs(1, isValue);
+            break;
+        case If:
+        {
+            // conditions, Block, Elif..., then an optional Else
+            unsigned Elifs = Size - (Size > 2 && kindIs(Size - 1, isElse));
+            Fits = Op == 0 && Size >= 2 && kindIs(0, isTest) &&
+                   kindIs(1, isBlock) && allAre(2, Elifs, isElif);
+            break;
+        }
+        case Elif:
+        case Loop:
+            Fits = Op == 0 && Size == 2 && kindIs(0, isTest) &&
+                   kindIs(1, isBlock);
+            break;
+        case Else:
+            Fits = Op == 0 && Size == 1 && kindIs(0, isBlock);
+            break;
+        case BinaryOp:
+            // the assignment operators never make it into an expression
+            Fits = Op <= ::BinaryOp::KW_mod && Op != ::BinaryOp::equal &&
+                   Size == 2 && allAre(0, 2, isValue);
+            break;
+        case Condition:
+            Fits = Op <= ::Condition::KW_greaterThan && Size == 2 &&
+                   allAre(0, 2, isValue);
+            break;
+        default: // Conditions
+            Fits = Op <= ::Conditions::KW_or && Size == 2 &&
+                   allAre(0, 2, isTest);
+            break;
+        }
+        if (!Fits)
+            return false;
+    }
+    return Kinds.back() == Program;
+}
+
+FlatAST FlatAST::build(AST *Tree, unsigned SizeHint)
+{
+    FlatAST Flat;
+    Flat.reserve(SizeHint);
+    FlatBuilder Builder(Flat);
+    Tree->accept(Builder);
+    Flat.shrinkToFit();
+    return Flat;
+}
+
+// A .gsmast file holds a FlatAST in the byte order of the machine that
+// wrote it: a FileHeader, then the node arrays as they are in memory, each
+// starting at a multiple of 4 bytes from the start of the file,
+//   Kinds[NumNodes], Ops[NumNodes], Offsets[NumNodes + 1],
+//   Children[NumChildren], Names[NumNames], Payloads[NumPayloads],
+//   Messages[NumMessages],
+// where names, literals and the texts of messages are FileStrings,
+// (offset, size) pairs relative to the string bytes at the end. Version
+// changes with the layout of the file or the meaning of the arrays, so an
+// older file is rejected rather than misread; a file of another byte order
+// fails the same check.
+namespace
+{
+    const char FileMagic[8] = {'G', 'S', 'M', 'A', 'S', 'T', '\0', '\0'};
+    const uint32_t FileVersion = 2;
+
+    struct FileHeader
+    {
+        char Magic[8];
+        uint32_t Version;
+        uint32_t NumNodes;
+        uint32_t NumChildren;
+        uint32_t NumNames;
+        uint32_t NumPayloads;
+        uint32_t StringSize;
+        uint32_t NumMessages;
+        uint32_t Passes;
+        uint64_t SourceHash;
+    };
+
+    struct FileString
+    {
+        uint32_t Offset;
+        uint32_t Size;
+    };
+
+    struct FileMessage
+    {
+        uint32_t Severity;
+        uint32_t Offset; // in the source
+        FileString Text;
+    };
+
+    // where the arrays start in a file with the header H
+    struct FileLayout
+    {
+        uint64_t Kinds, Ops, Offsets, Children, Names, Payloads, Messages,
+            Strings, End;
+
+        FileLayout(const FileHeader &H)
+        {
+            Kinds = sizeof(FileHeader);
+            Ops = Kinds + H.NumNodes;
+            Offsets = llvm::alignTo(Ops + H.NumNodes, 4);
+            Children = Offsets + (uint64_t(H.NumNodes) + 1) * sizeof(uint32_t);
+            Names = Children + uint64_t(H.NumChildren) * sizeof(uint32_t);
+            Payloads = Names + uint64_t(H.NumNames) * sizeof(FileString);
+            Messages = Payloads + uint64_t(H.NumPayloads) * sizeof(FileString);
+            Strings = Messages + uint64_t(H.NumMessages) * sizeof(FileMessage);
+            End = Strings + H.StringSize;
+        }
+    };
+
+    template <typename T>
+    void writeArray(llvm::raw_ostream &OS, llvm::ArrayRef<T> Array)
+    {
+        OS.write(reinterpret_cast<const char *>(Array.data()),
+                 Array.size() * sizeof(T));
+    }
+
+    // String, appended to Bytes
+    FileString packString(llvm::StringRef String, std::string &Bytes)
+    {
+        FileString Packed{uint32_t(Bytes.size()), uint32_t(String.size())};
+        Bytes.append(String.begin(), String.end());
+        return Packed;
+    }
+
+    // the strings of Strings, appended to Bytes
+    llvm::SmallVector<FileString, 0>
+    packStrings(llvm::ArrayRef<llvm::StringRef> Strings, std::string &Bytes)
+    {
+        llvm::SmallVector<FileString, 0> Packed;
+        Packed.reserve(Strings.size());
+        for (llvm::StringRef S : Strings)
+            Packed.push_back(packString(S, Bytes));
+        return Packed;
+    }
+
+    // the string of the file Buffer described by Packed, false if it is out
+    // of its string bytes
+    bool unpackString(llvm::StringRef Buffer, const FileLayout &Layout,
+                      FileString Packed, llvm::StringRef &String)
+    {
+        llvm::StringRef Bytes = Buffer.substr(Layout.Strings);
+        if (uint64_t(Packed.Offset) + Packed.Size > Bytes.size())
+            return false;
+        String = Bytes.substr(Packed.Offset, Packed.Size);
+        return true;
+    }
+
+    // the Num strings of the file Buffer packed at Begin, false if one of
+    // them is out of its string bytes
+    bool unpackStrings(llvm::StringRef Buffer, const FileLayout &Layout,
+                       uint64_t Begin, unsigned Num,
+                       llvm::SmallVectorImpl<llvm::StringRef> &Strings)
+    {
+        const auto *Packed =
+            reinterpret_cast<const FileString *>(Buffer.data() + Begin);
+        Strings.resize(Num);
+        for (unsigned I = 0; I != Num; ++I)
+            if (!unpackString(Buffer, Layout, Packed[I], Strings[I]))
+                return false;
+        return true;
+    }
+}
+
+uint64_t FlatAST::hashSource(llvm::StringRef Source)
+{
+    return llvm::xxHash64(Source);
+}
+
+bool FlatAST::write(llvm::StringRef Path, const FileInfo &Info,
+                    llvm::raw_ostream &Errs) const
+{
+    std::string Strings;
+    llvm::SmallVector<FileString, 0> PackedNames = packStrings(Names, Strings);
+    llvm::SmallVector<FileString, 0> PackedPayloads =
+        packStrings(Payloads, Strings);
+    llvm::SmallVector<FileMessage, 0> Messages;
+    for (const DiagnosticsEngine::Diagnostic &D : Info.Messages)
+        Messages.push_back(
+            FileMessage{D.Sev, D.Offset, packString(D.Message, Strings)});
+
+    FileHeader H;
+    std::copy(std::begin(FileMagic), std::end(FileMagic), H.Magic);
+    H.Version = FileVersion;
+    H.NumNodes = size();
+    H.NumChildren = Children.size();
+    H.NumNames = Names.size();
+    H.NumPayloads = Payloads.size();
+    H.StringSize = Strings.size();
+    H.NumMessages = Messages.size();
+    H.Passes = Info.Passes;
+    H.SourceHash = Info.SourceHash;
+    FileLayout Layout(H);
+
+    std::error_code EC;
+    llvm::raw_fd_ostream OS(Path, EC, llvm::sys::fs::OF_None);
+    if (EC)
+    {
+        Errs << "Cannot write " << Path << ": " << EC.message() << "\n";
+        return true;
+    }
+    OS.write(reinterpret_cast<const char *>(&H), sizeof(H));
+    writeArray(OS, Kinds);
+    writeArray(OS, Ops);
+    OS.write_zeros(Layout.Offsets - OS.tell());
+    writeArray(OS, Offsets);
+    writeArray(OS, Children);
+    writeArray<FileString>(OS, PackedNames);
+    writeArray<FileString>(OS, PackedPayloads);
+    writeArray<FileMessage>(OS, Messages);
+    OS << Strings;
+    OS.close();
+    if (OS.has_error())
+    {
+        Errs << "Cannot write " << Path << ": " << OS.error().message()
+             << "\n";
+        OS.clear_error();
+        return true;
+    }
+    assert(OS.tell() == Layout.End && "file does not match its layout");
+    return false;
+}
+
+llvm::Optional<FlatAST> FlatAST::load(llvm::StringRef Path, FileInfo &Info,
+                                      llvm::raw_ostream &Errs)
+{
+    llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> FileOrErr =
+        llvm::MemoryBuffer::getFile(Path, /*IsText=*/false,
+                                    /*RequiresNullTerminator=*/false);
+    if (std::error_code EC = FileOrErr.getError())
+    {
+        Errs << "Cannot read " << Path << ": " << EC.message() << "\n";
+        return llvm::None;
+    }
+    llvm::StringRef Buffer = (*FileOrErr)->getBuffer();
+
+    FileHeader H;
+    if (Buffer.size() < sizeof(H))
+        goto _error;
+    std::memcpy(&H, Buffer.data(), sizeof(H));
+    if (!std::equal(std::begin(FileMagic), std::end(FileMagic), H.Magic) ||
+        H.Version != FileVersion || H.NumNodes == 0)
+        goto _error;
+
+    {
+        FileLayout Layout(H);
+        if (Layout.End != Buffer.size())
+            goto _error;
+
+        FlatAST Tree;
+        const char *Base = Buffer.data();
+        Tree.Kinds = llvm::makeArrayRef(
+            reinterpret_cast<const NodeKind *>(Base + Layout.Kinds), H.NumNodes);
+        Tree.Ops = llvm::makeArrayRef(
+            reinterpret_cast<const uint8_t *>(Base + Layout.Ops), H.NumNodes);
+        Tree.Offsets = llvm::makeArrayRef(
+            reinterpret_cast<const uint32_t *>(Base + Layout.Offsets),
+            H.NumNodes + 1);
+        Tree.Children = llvm::makeArrayRef(
+            reinterpret_cast<const uint32_t *>(Base + Layout.Children),
+            H.NumChildren);
+        // the strings are unpacked first, the leaves are checked against
+        // them
+        if (!unpackStrings(Buffer, Layout, Layout.Names, H.NumNames,
+                           Tree.Names) ||
+            !unpackStrings(Buffer, Layout, Layout.Payloads, H.NumPayloads,
+                           Tree.Payloads) ||
+            !Tree.isWellFormed())
+            goto _error;
+
+        const auto *Messages =
+            reinterpret_cast<const FileMessage *>(Base + Layout.Messages);
+        Info.Messages.clear();
+        for (unsigned I = 0; I != H.NumMessages; ++I)
+        {
+            llvm::StringRef Text;
+            if (Messages[I].Severity > DiagnosticsEngine::Error ||
+                !unpackString(Buffer, Layout, Messages[I].Text, Text))
+                goto _error;
+            Info.Messages.push_back(DiagnosticsEngine::Diagnostic{
+                DiagnosticsEngine::Severity(Messages[I].Severity),
+                Messages[I].Offset, Text.str()});
+        }
+
+        Tree.File = std::move(*FileOrErr);
+        Info.SourceHash = H.SourceHash;
+        Info.Passes = H.Passes;
+        return Tree;
+    }
+
+_error:
+    Errs << Path << " is not an AST file of this version of gsm\n";
+    return llvm::None;
+}
@@ -0,0 +1,257 @@
+#ifndef FLATAST_H
+#define FLATAST_H
+
+#include "AST.h"
+#include "Diagnostics.h"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/Optional.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+#include <cassert>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// FlatAST holds a tree as parallel arrays instead of separately allocated
+// objects: per node a 1-byte kind, a 1-byte operator and a 32-bit offset
+// into Children, where the references to its children are stored. Nodes
+// are added one after the other with their children, so the children of
+// node N end where those of node N + 1 begin and no count is stored. A
+// leaf has a single entry there instead: the symbol ID of an identifier
+// (see Interner.h), whose name is in Names, or the index of a literal in
+// Payloads, which holds every distinct literal once. Nodes are referred
+// to by 32-bit index, so a node costs 10 bytes, and walking the tree
+// touches a few dense arrays.
+//
+// Nodes are stored in post-order: the children of a node always come
+// before it, the subtree of a node is the contiguous range from its first
+// descendant up to itself, and the root is the last node. An expression
+// can thus be evaluated by a plain loop over its range, keeping operands
+// on a stack.
+//
+// A tree can be written to a .gsmast file and loaded again (see
+// FlatAST.cpp for the format). The file holds the node arrays as they are
+// in memory, so loading maps it and points the arrays into it; only the
+// names and literals are collected into StringRefs, nothing is done per
+// node. The file also records the source the tree was parsed from, the
+// passes that ran on it and the messages they reported (FileInfo), so that
+// a tree cached for a source is only reused under the same settings, and
+// the messages are reported again when it is.
+class FlatAST
+{
+public:
+    using NodeRef = uint32_t;
+
+    enum NodeKind : uint8_t
+    {
+        Program,     // the statements
+        Block,       // the statements of a body, a scope
+        Declaration, // VarDecl..., then the initializer if getOp() is 1
+        Equation,    // Id of the target, value; getOp() is 1 if the store is dead
+        If,          // conditions, Block, Elif..., then an optional Else
+        Elif,        // conditions, Block
+        Else,        // Block
+        Loop,        // conditions, Block
+        BinaryOp,    // left, right; getOp() is a BinaryOp::Operator
+        Condition,   // left, right; getOp() is a Condition::OperatorCondition
+        Conditions,  // left, right; getOp() is a Conditions::andOr
+        Num,         // integer literal, its text in the payload
+        Id,          // use of a variable, by symbol ID
+        VarDecl      // variable declared by a Declaration, by symbol ID;
+                     // getOp() is a Declaration::VarUse
+    };
+
+private:
+    // the node arrays, views of the storage below or of a loaded file
+    llvm::ArrayRef<NodeKind> Kinds;
+    llvm::ArrayRef<uint8_t> Ops;
+    llvm::ArrayRef<uint32_t> Offsets;  // first entry in Children, plus one
+                                       // past the last node
+    llvm::ArrayRef<uint32_t> Children; // children, or payload of a leaf
+    llvm::SmallVector<llvm::StringRef, 0> Names; // indexed by symbol ID
+    llvm::SmallVector<llvm::StringRef, 0> Payloads;
+
+    // storage of a tree built in memory
+    llvm::SmallVector<NodeKind, 0> KindStore;
+    llvm::SmallVector<uint8_t, 0> OpStore;
+    llvm::SmallVector<uint32_t, 0> OffsetStore;
+    llvm::SmallVector<uint32_t, 0> ChildStore;
+    llvm::DenseMap<llvm::StringRef, uint32_t> PayloadIndex;
+
+    // the file a loaded tree lives in
+    std::unique_ptr<llvm::MemoryBuffer> File;
+
+    // points the arrays at the storage after it changed
+    void updateArrays()
+    {
+        Kinds = KindStore;
+        Ops = OpStore;
+        Offsets = OffsetStore;
+        Children = ChildStore;
+    }
+
+public:
+    FlatAST() : OffsetStore(1, 0) { updateArrays(); }
+
+    // the arrays may point into the storage, so it is never copied
+    FlatAST(const FlatAST &) = delete;
+    FlatAST &operator=(const FlatAST &) = delete;
+
+    FlatAST(FlatAST &&Other) { *this = std::move(Other); }
+
+    FlatAST &operator=(FlatAST &&Other)
+    {
+        Names = std::move(Other.Names);
+        Payloads = std::move(Other.Payloads);
+        KindStore = std::move(Other.KindStore);
+        OpStore = std::move(Other.OpStore);
+        OffsetStore = std::move(Other.OffsetStore);
+        ChildStore = std::move(Other.ChildStore);
+        PayloadIndex = std::move(Other.PayloadIndex);
+        File = std::move(Other.File);
+        Kinds = Other.Kinds;
+        Ops = Other.Ops;
+        Offsets = Other.Offsets;
+        Children = Other.Children;
+        if (!File)
+            updateArrays();
+        return *this;
+    }
+
+    // passes that change the tree before it is written
+    enum PassFlags : uint32_t
+    {
+        HashConsed = 1,  // parsed with -cse
+        ConstFolded = 2, // -const-fold
+        DefUseMarked = 4 // -def-use
+    };
+
+    // what a .gsmast file records besides the tree
+    struct FileInfo
+    {
+        uint64_t SourceHash = 0; // identifies the source parsed
+        uint32_t Passes = 0;     // PassFlags of the passes run on the tree
+        // the messages those passes reported, located in the source
+        std::vector<DiagnosticsEngine::Diagnostic> Messages;
+    };
+
+    // flattens the pointer tree rooted at Tree, which must be a GSM;
+    // SizeHint is the expected number of nodes, if known
+    static FlatAST build(AST *Tree, unsigned SizeHint = 0);
+
+    // writes the tree and Info to the .gsmast file Path; returns true on
+    // error
+    bool write(llvm::StringRef Path, const FileInfo &Info,
+               llvm::raw_ostream &Errs) const;
+
+    // loads the .gsmast file Path and what it records into Info, reports
+    // an error to Errs and returns None if Path is not a tree written by
+    // this version
+    static llvm::Optional<FlatAST> load(llvm::StringRef Path, FileInfo &Info,
+                                        llvm::raw_ostream &Errs);
+
+    // the hash a source is identified by in a .gsmast file
+    static uint64_t hashSource(llvm::StringRef Source);
+
+    // makes room for NumNodes nodes
+    void reserve(unsigned NumNodes);
+
+    // frees unused capacity and the index used to share payloads, leaves
+    // added later do not share their text with earlier ones
+    void shrinkToFit();
+
+    // appends a Num leaf with the text Text
+    NodeRef addLeaf(NodeKind Kind, llvm::StringRef Text);
+
+    // appends an Id or VarDecl leaf for the symbol Symbol named Name
+    NodeRef addSymbol(NodeKind Kind, unsigned Symbol, llvm::StringRef Name,
+                      unsigned Op = 0);
+
+    // appends a node over Kids, which must all be in the tree already
+    NodeRef addNode(NodeKind Kind, unsigned Op, llvm::ArrayRef<NodeRef> Kids);
+
+    unsigned size() const { return Kinds.size(); }
+
+    bool empty() const { return Kinds.empty(); }
+
+    NodeRef getRoot() const
+    {
+        assert(!empty() && "empty tree has no root");
+        return size() - 1;
+    }
+
+    NodeKind getKind(NodeRef N) const { return Kinds[N]; }
+
+    unsigned getOp(NodeRef N) const { return Ops[N]; }
+
+    static bool isLeaf(NodeKind Kind) { return Kind >= Num; }
+
+    static bool isSymbol(NodeKind Kind) { return Kind >= Id; }
+
+    // whether the arrays live in a file mapped by load()
+    bool isLoaded() const { return File != nullptr; }
+
+    // whether the arrays form a tree build() could have made: the readers
+    // below and the passes over a FlatAST index, cast and walk them
+    // without checking, so a loaded tree is checked once instead
+    bool isWellFormed() const;
+
+    llvm::ArrayRef<NodeRef> getChildren(NodeRef N) const
+    {
+        if (isLeaf(Kinds[N]))
+            return llvm::None;
+        return llvm::makeArrayRef(Children.data() + Offsets[N],
+                                  Children.data() + Offsets[N + 1]);
+    }
+
+    NodeRef getChild(NodeRef N, unsigned I) const
+    {
+        assert(I < getNumChildren(N) && "child index out of range");
+        return Children[Offsets[N] + I];
+    }
+
+    unsigned getNumChildren(NodeRef N) const
+    {
+        return isLeaf(Kinds[N]) ? 0 : Offsets[N + 1] - Offsets[N];
+    }
+
+    // the symbol ID of an Id or VarDecl leaf
+    unsigned getSymbol(NodeRef N) const
+    {
+        assert(isSymbol(Kinds[N]) && "only identifiers have a symbol");
+        return Children[Offsets[N]];
+    }
+
+    // the name or literal of a leaf
+    llvm::StringRef getText(NodeRef N) const
+    {
+        assert(isLeaf(Kinds[N]) && "only leaves have a text");
+        if (isSymbol(Kinds[N]))
+            return Names[Children[Offsets[N]]];
+        return Payloads[Children[Offsets[N]]];
+    }
+
+    // the first node of the subtree rooted at N in post-order, i.e. the
+    // subtree is the range [getFirstDescendant(N), N]
+    NodeRef getFirstDescendant(NodeRef N) const
+    {
+        while (!isLeaf(Kinds[N]) && Offsets[N] != Offsets[N + 1])
+            N = Children[Offsets[N]];
+        return N;
+    }
+
+    // bytes used by the arrays, or by the file they were loaded from
+    size_t getMemorySize() const
+    {
+        return KindStore.capacity_in_bytes() + OpStore.capacity_in_bytes() +
+               OffsetStore.capacity_in_bytes() +
+               ChildStore.capacity_in_bytes() + Names.capacity_in_bytes() +
+               Payloads.capacity_in_bytes() + PayloadIndex.getMemorySize() +
+               (File ? File->getBufferSize() : 0);
+    }
+};
+
+#endif
@@ -0,0 +1,101 @@
+// Writes a .gsmast file, changes the kind of one of its nodes and checks
+// that FlatAST::load() turns the file down: a node of the wrong type where
+// the grammar wants a value or a test gives invalid IR if it gets through.
+#include "FlatAST.h"
+#include "Lexer.h"
+#include "Parser.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+#include <string>
+
+namespace
+{
+    // a program with an expression, a condition and a statement using both
+    const char *Program = "int a = 1;\n"
+                          "if a > 0 : begin a = a + 2; end\n";
+
+    // writes Tree to Path with the kind of its first From node set to To;
+    // returns false if it cannot
+    bool writeFlipped(const FlatAST &Tree, llvm::StringRef Path,
+                      FlatAST::NodeKind From, FlatAST::NodeKind To)
+    {
+        if (Tree.write(Path, FlatAST::FileInfo(), llvm::errs()))
+            return false;
+        auto File = llvm::MemoryBuffer::getFile(Path);
+        if (!File)
+            return false;
+        std::string Bytes = (*File)->getBuffer().str();
+
+        // the kinds are stored one byte a node, in the order of the tree
+        std::string Kinds;
+        for (unsigned N = 0; N < Tree.size(); ++N)
+            Kinds += static_cast<char>(Tree.getKind(N));
+        size_t Start = Bytes.find(Kinds);
+        size_t Node = Kinds.find(static_cast<char>(From));
+        if (Start == std::string::npos || Node == std::string::npos)
+            return false;
+        Bytes[Start + Node] = static_cast<char>(To);
+
+        std::error_code EC;
+        llvm::raw_fd_ostream Out(Path, EC);
+        if (EC)
+            return false;
+        Out << Bytes;
+        return true;
+    }
+}
+
+int main()
+{
+    DiagnosticsEngine Diags(llvm::errs());
+    Lexer Lex(Program);
+    Parser P(Lex, Diags);
+    AST *Parsed = P.parse();
+    if (!Parsed || P.hasError())
+    {
+        llvm::errs() << "flat-ast: the program has syntax errors\n";
+        return 1;
+    }
+    FlatAST Tree = FlatAST::build(Parsed);
+
+    llvm::SmallString<128> Path;
+    if (llvm::sys::fs::createTemporaryFile("gsm-flat-ast", "gsmast", Path))
+        return 1;
+
+    bool Failed = false;
+    FlatAST::FileInfo Info;
+    if (Tree.write(Path, Info, llvm::errs()) ||
+        !FlatAST::load(Path, Info, llvm::errs()))
+    {
+        llvm::outs() << "flat-ast: the file as written does not load!\n";
+        Failed = true;
+    }
+
+    // an i1 where an i32 is wanted, and the other way round
+    struct
+    {
+        FlatAST::NodeKind From, To;
+        const char *What;
+    } Flips[] = {{FlatAST::BinaryOp, FlatAST::Condition, "a condition as a value"},
+                 {FlatAST::Condition, FlatAST::BinaryOp, "a value as a test"}};
+    for (auto &Flip : Flips)
+    {
+        if (!writeFlipped(Tree, Path, Flip.From, Flip.To))
+        {
+            llvm::outs() << "flat-ast: cannot write the file with "
+                         << Flip.What << "\n";
+            Failed = true;
+        }
+        else if (FlatAST::load(Path, Info, llvm::nulls()))
+        {
+            llvm::outs() << "flat-ast: the file with " << Flip.What
+                         << " loads!\n";
+            Failed = true;
+        }
+    }
+
+    llvm::sys::fs::remove(Path);
+    return Failed;
+}
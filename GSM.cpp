@@ -1,15 +1,226 @@
+#include "Bench.h"
 #include "CodeGen.h"
+#include "ConstFold.h"
+#include "DefUse.h"
+#include "Diagnostics.h"
+#include "FlatAST.h"
 #include "Parser.h"
 #include "Sema.h"
+#include "TokenStream.h"
+#include "llvm/ADT/Optional.h"
+#include "llvm/ADT/SmallString.h"
 #include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
 #include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
 #include "llvm/Support/raw_ostream.h"
 
-// Define a command-line option for specifying the input expression.
+// Define a command-line option for specifying the input file, "-" reads
+// the program from the standard input.
 static llvm::cl::opt<std::string>
-    Input(llvm::cl::Positional,
-          llvm::cl::desc("<input expression>"),
-          llvm::cl::init(""));
+    InputFilename(llvm::cl::Positional,
+                  llvm::cl::desc("<input file>"),
+                  llvm::cl::init("-"));
+
+// Define a command-line option for passing the program text directly.
+static llvm::cl::opt<std::string>
+    InputExpr("e",
+              llvm::cl::desc("Compile the given program text instead of a file"),
+              llvm::cl::value_desc("program"));
+
+// Define command-line options for lexing the input while it is being read.
+static llvm::cl::opt<bool>
+    StreamInput("stream",
+                llvm::cl::desc("Lex the input file or pipe in chunks while "
+                               "it is read instead of loading it first"),
+                llvm::cl::init(false));
+
+static llvm::cl::opt<unsigned>
+    StreamChunkSize("stream-chunk-size",
+                    llvm::cl::desc("Bytes read at a time with -stream"),
+                    llvm::cl::init(64 * 1024));
+
+// Define a command-line option for lexing the whole input before parsing.
+static llvm::cl::opt<bool>
+    Pretokenize("pretokenize",
+                llvm::cl::desc("Lex the whole input into a token stream "
+                               "before parsing"),
+                llvm::cl::init(false));
+
+// Define a command-line option for parsing top-level statements in parallel.
+static llvm::cl::opt<unsigned>
+    ParseThreads("parse-threads",
+                 llvm::cl::desc("Parse top-level statements on this many "
+                                "threads, implies -pretokenize (0 = serial)"),
+                 llvm::cl::init(0));
+
+// Define a command-line option for limiting the number of errors.
+static llvm::cl::opt<unsigned>
+    ErrorLimit("error-limit",
+               llvm::cl::desc("Stop reporting errors after this many, and "
+                              "skip the rest of the input if they are syntax "
+                              "errors (0 = no limit)"),
+               llvm::cl::init(20));
+
+// Define a command-line option for the format of errors and warnings.
+static llvm::cl::opt<DiagnosticsEngine::OutputFormat>
+    DiagFormat("diagnostics-format",
+               llvm::cl::desc("Format of errors and warnings"),
+               llvm::cl::values(clEnumValN(DiagnosticsEngine::Text, "text",
+                                           "file:line:column: severity: message"),
+                                clEnumValN(DiagnosticsEngine::JSON, "json",
+                                           "One JSON object per line")),
+               llvm::cl::init(DiagnosticsEngine::Text));
+
+// Define a command-line option for compiling a flat copy of the AST instead
+// of the pointer tree.
+static llvm::cl::opt<bool>
+    UseFlatAST("flat-ast",
+               llvm::cl::desc("Run code generation on a flat, index-based "
+                              "copy of the AST"),
+               llvm::cl::init(false));
+
+// Define a command-line option for folding constants before code generation.
+static llvm::cl::opt<bool>
+    FoldConstants("const-fold",
+                  llvm::cl::desc("Fold expressions whose value is known "
+                                 "from the ranges of the variables"),
+                  llvm::cl::init(true));
+
+// Define a command-line option for the def-use analysis before code
+// generation.
+static llvm::cl::opt<bool>
+    AnalyzeDefUse("def-use",
+                  llvm::cl::desc("Warn about reads of uninitialized variables "
+                                 "and leave out dead stores and unread "
+                                 "variables"),
+                  llvm::cl::init(true));
+
+// Define command-line options for optimizing the generated IR.
+static llvm::cl::opt<unsigned>
+    OptLevel("O",
+             llvm::cl::desc("Optimization level, -O0 to -O3 (default -O0, "
+                            "the IR as it is generated)"),
+             llvm::cl::Prefix, llvm::cl::init(0));
+
+static llvm::cl::opt<bool>
+    PrintPassTimings("print-pass-timings",
+                     llvm::cl::desc("Print the time taken by every "
+                                    "optimization pass"),
+                     llvm::cl::init(false));
+
+// Define a command-line option for running the program instead of printing
+// its IR.
+static llvm::cl::opt<bool>
+    RunProgram("run",
+               llvm::cl::desc("Compile the program with the JIT and run it "
+                              "in-process, reporting the compile and run "
+                              "times"),
+               llvm::cl::init(false));
+
+// Define command-line options for the output.
+static llvm::cl::opt<Emitter::FileType>
+    EmitType("emit", llvm::cl::desc("Kind of output"),
+             llvm::cl::values(clEnumValN(Emitter::LL, "ll",
+                                         "Textual LLVM IR (default)"),
+                              clEnumValN(Emitter::BC, "bc", "LLVM bitcode"),
+                              clEnumValN(Emitter::Asm, "asm",
+                                         "Assembly for the host"),
+                              clEnumValN(Emitter::Obj, "obj",
+                                         "Object file for the host"),
+                              clEnumValN(Emitter::Exe, "exe",
+                                         "Executable linked with the "
+                                         "static runtime")),
+             llvm::cl::init(Emitter::LL));
+
+static llvm::cl::opt<std::string>
+    OutputFilename("o",
+                   llvm::cl::desc("Output file, - for the standard output "
+                                  "(default; a.out for --emit=exe)"),
+                   llvm::cl::value_desc("file"), llvm::cl::init("-"));
+
+static llvm::cl::opt<std::string>
+    RuntimeLib("runtime-lib",
+               llvm::cl::desc("Static runtime --emit=exe links with "
+                              "(default: libgsmrt.a next to gsm)"),
+               llvm::cl::value_desc("file"));
+
+// Define command-line options for splitting large programs into functions
+// that are optimized and compiled in parallel.
+static llvm::cl::opt<unsigned>
+    PartitionSize("partition-size",
+                  llvm::cl::desc("Emit the top-level statements in functions "
+                                 "of this many statements, called by main in "
+                                 "turn (0 = all in main)"),
+                  llvm::cl::init(0));
+
+static llvm::cl::opt<unsigned>
+    CodegenThreads("codegen-threads",
+                   llvm::cl::desc("Split --emit=obj and --emit=exe output "
+                                  "by function and optimize and compile the "
+                                  "parts on this many threads"),
+                   llvm::cl::init(1));
+
+// Define a command-line option for sharing repeated subexpressions.
+static llvm::cl::opt<bool>
+    CSE("cse",
+        llvm::cl::desc("Share structurally equal expressions in the AST and "
+                       "reuse their values in code generation"),
+        llvm::cl::init(false));
+
+// Define a command-line option for caching the AST of the input in a file.
+static llvm::cl::opt<std::string>
+    EmitAST("emit-ast",
+            llvm::cl::desc("Write the AST to this .gsmast file, or load it "
+                           "from there if it was written for the same "
+                           "input; implies -flat-ast"),
+            llvm::cl::value_desc("file"));
+
+// Define a command-line option for reporting the memory used by the AST.
+static llvm::cl::opt<bool>
+    ASTStats("ast-stats",
+             llvm::cl::desc("Print the number of AST nodes and arena bytes"),
+             llvm::cl::init(false));
+
+// Define command-line options for running a phase benchmark on the input
+// instead of compiling it.
+enum BenchKind
+{
+    NoBench,
+    BenchLexer,
+    BenchKeywords,
+    BenchParser,
+    BenchNesting,
+    BenchScopes,
+    BenchTraversal,
+    BenchCSE
+};
+
+static llvm::cl::opt<BenchKind>
+    BenchMode("bench",
+              llvm::cl::desc("Benchmark a compiler phase on the input"),
+              llvm::cl::values(clEnumValN(BenchLexer, "lexer",
+                                          "Lexer throughput per scanner"),
+                               clEnumValN(BenchKeywords, "keywords",
+                                          "Keyword lookup, hash vs compares"),
+                               clEnumValN(BenchParser, "parser",
+                                          "Parser throughput"),
+                               clEnumValN(BenchNesting, "nesting",
+                                          "Compile time against nesting depth"),
+                               clEnumValN(BenchScopes, "scopes",
+                                          "Sema time of nested, shadowing blocks"),
+                               clEnumValN(BenchTraversal, "traversal",
+                                          "AST walk, virtual vs static dispatch"),
+                               clEnumValN(BenchCSE, "cse",
+                                          "IR size with -cse, checked by "
+                                          "running both")),
+              llvm::cl::init(NoBench));
+
+static llvm::cl::opt<unsigned>
+    BenchIterations("bench-iterations",
+                    llvm::cl::desc("Number of timed runs per benchmark"),
+                    llvm::cl::init(5));
 
 // The main function of the program.
 int main(int argc, const char **argv)
@@ -20,34 +231,259 @@ int main(int argc, const char **argv)
     // Parse command-line options.
     llvm::cl::ParseCommandLineOptions(argc, argv, "GSM - the expression compiler\n");
 
-    // Create a lexer object and initialize it with the input expression.
-    Lexer Lex(Input);
-
-    // Create a parser object and initialize it with the lexer.
-    Parser Parser(Lex);
+    // A .gsmast input holds a parsed AST, which is compiled as it is.
+    bool ASTInput = !InputExpr.getNumOccurrences() &&
+                    llvm::StringRef(InputFilename).endswith(".gsmast");
 
-    // Parse the input expression and generate an abstract syntax tree (AST).
-    AST *Tree = Parser.parse();
+    // A streamed input is never held in memory as a whole, so it can only
+    // be lexed on demand.
+    if (StreamInput && (InputExpr.getNumOccurrences() || Pretokenize ||
+                        ParseThreads || BenchMode != NoBench || ASTInput ||
+                        !EmitAST.empty()))
+    {
+        llvm::errs() << "-stream cannot be used with -e, -pretokenize, "
+                        "-parse-threads, -bench, -emit-ast or an AST input\n";
+        return 1;
+    }
 
-    // Check if parsing was successful or if there were any syntax errors.
-    if (!Tree || Parser.hasError())
+    // Load the program. Regular files are memory-mapped, and the lexer, the
+    // tokens and the AST refer to the buffer directly, so it is never copied.
+    std::unique_ptr<llvm::MemoryBuffer> Buffer;
+    llvm::sys::fs::file_t StreamFile = llvm::sys::fs::kInvalidFile;
+    if (StreamInput)
+    {
+        if (InputFilename == "-")
+            StreamFile = llvm::sys::fs::getStdinHandle();
+        else
+        {
+            llvm::Expected<llvm::sys::fs::file_t> FileOrErr =
+                llvm::sys::fs::openNativeFileForRead(InputFilename);
+            if (!FileOrErr)
+            {
+                llvm::errs() << "Cannot read " << InputFilename << ": "
+                             << llvm::toString(FileOrErr.takeError()) << "\n";
+                return 1;
+            }
+            StreamFile = *FileOrErr;
+        }
+    }
+    else if (BenchMode == BenchNesting || BenchMode == BenchScopes || ASTInput)
+        ; // generates its own input, or is loaded by FlatAST::load()
+    else if (InputExpr.getNumOccurrences())
+        Buffer = llvm::MemoryBuffer::getMemBuffer(InputExpr, "<command line>");
+    else
     {
-        llvm::errs() << "Syntax errors occurred\n";
+        llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> BufferOrErr =
+            llvm::MemoryBuffer::getFileOrSTDIN(InputFilename, /*IsText=*/false,
+                                               /*RequiresNullTerminator=*/true);
+        if (std::error_code EC = BufferOrErr.getError())
+        {
+            llvm::errs() << "Cannot read " << InputFilename << ": "
+                         << EC.message() << "\n";
+            return 1;
+        }
+        Buffer = std::move(*BufferOrErr);
+    }
+    llvm::StringRef Input = Buffer ? Buffer->getBuffer() : llvm::StringRef();
+
+    // Errors and warnings are collected and printed at the end of a phase.
+    DiagnosticsEngine Diags(llvm::errs(), DiagFormat);
+    llvm::StringRef InputName = InputFilename;
+    if (InputExpr.getNumOccurrences())
+        InputName = "<command line>";
+    else if (InputName == "-")
+        InputName = "<stdin>";
+    Diags.setSource(InputName, Input);
+    Diags.setErrorLimit(ErrorLimit);
+
+    // Prints the messages of a failed phase, then the phase, except for
+    // tools reading JSON.
+    auto fail = [&](const char *Phase) {
+        Diags.flush();
+        if (Diags.getFormat() == DiagnosticsEngine::Text)
+            llvm::errs() << Phase << " errors occurred\n";
         return 1;
+    };
+
+    // Run the requested benchmark instead of compiling.
+    if (BenchMode != NoBench)
+    {
+        Bench Benchmark(BenchIterations);
+        switch (BenchMode)
+        {
+        case BenchLexer:
+            Benchmark.lexer(Input);
+            break;
+        case BenchKeywords:
+            Benchmark.keywords(Input);
+            break;
+        case BenchParser:
+            Benchmark.parser(Input);
+            break;
+        case BenchNesting:
+            Benchmark.nesting();
+            break;
+        case BenchScopes:
+            Benchmark.scopes();
+            break;
+        case BenchTraversal:
+            Benchmark.traversal(Input);
+            break;
+        case BenchCSE:
+            Benchmark.cse(Input);
+            break;
+        case NoBench:
+            break;
+        }
+        return 0;
+    }
+
+    // The flat AST, loaded from a .gsmast file or flattened from the parsed
+    // tree. A -emit-ast file written for the same input, identified by its
+    // hash, under the same settings of the passes that change the tree is
+    // loaded instead of parsing it again; the messages of those passes are
+    // kept in the file and reported again.
+    llvm::Optional<FlatAST> Flat;
+    FlatAST::FileInfo Info, Cached;
+    if (ASTInput)
+    {
+        Flat = FlatAST::load(InputFilename, Cached, llvm::errs());
+        if (!Flat)
+            return 1;
+        Cached.Messages.clear(); // they point into a source not at hand
+    }
+    else if (!EmitAST.empty())
+    {
+        Info.SourceHash = FlatAST::hashSource(Input);
+        if (CSE)
+            Info.Passes |= FlatAST::HashConsed;
+        if (FoldConstants)
+            Info.Passes |= FlatAST::ConstFolded;
+        if (AnalyzeDefUse)
+            Info.Passes |= FlatAST::DefUseMarked;
+        if (llvm::sys::fs::exists(EmitAST))
+            Flat = FlatAST::load(EmitAST, Cached, llvm::nulls());
+        if (Flat && (Cached.SourceHash != Info.SourceHash ||
+                     Cached.Passes != Info.Passes))
+        {
+            Flat.reset();
+            Cached.Messages.clear();
+        }
+    }
+
+    // The front end, unless the AST was loaded. The parser owns the arena
+    // of the AST, so it lives until the end.
+    llvm::Optional<Lexer> Lex;
+    llvm::Optional<TokenStream> Tokens;
+    llvm::Optional<Parser> Parser;
+    AST *Tree = nullptr;
+    if (!Flat)
+    {
+        // Create a lexer object and initialize it with the input expression
+        // or the stream to read it from.
+        if (StreamInput)
+        {
+            Lex.emplace(StreamFile, StreamChunkSize);
+            Diags.setStreamedSource(InputName, [&Lex](const char *Loc) {
+                return Lex->getOffset(Loc);
+            });
+        }
+        else
+            Lex.emplace(Input);
+
+        // Optionally lex the whole input up front.
+        if (Pretokenize || ParseThreads)
+            Tokens.emplace(Input);
+
+        // Create a parser object and initialize it with the lexer or the
+        // tokens.
+        if (Tokens)
+            Parser.emplace(*Tokens, Diags);
+        else
+            Parser.emplace(*Lex, Diags);
+        Parser->getContext().setHashConsing(CSE);
+
+        // Parse the input expression and generate an abstract syntax tree
+        // (AST).
+        Tree = ParseThreads ? Parser->parseParallel(ParseThreads)
+                            : Parser->parse();
+        if (StreamInput && InputFilename != "-")
+            llvm::sys::fs::closeFile(StreamFile);
+
+        // A streamed input cut short by a read error is not compiled, the
+        // syntax errors it caused are printed after the read error.
+        if (Lex && Lex->hasReadError())
+        {
+            Diags.error(nullptr, "Cannot read input: " + Lex->getReadError());
+            Diags.flush();
+            return 1;
+        }
+
+        if (ASTStats)
+        {
+            ASTContext &Context = Parser->getContext();
+            llvm::errs() << "AST: " << Context.getNumNodes() << " nodes, "
+                         << Context.getBytesUsed() << " bytes used, "
+                         << Context.getBytesReserved() << " bytes reserved\n";
+        }
+
+        // Check if parsing was successful or if there were any syntax errors.
+        if (!Tree || Parser->hasError())
+            return fail("Syntax");
     }
 
     // Perform semantic analysis on the AST.
-    Sema Semantic;
-    if (Semantic.semantic(Tree))
+    Sema Semantic(Diags);
+    if (Flat ? Semantic.semantic(*Flat) : Semantic.semantic(Tree))
+        return fail("Semantic");
+
+    // Fold constants in a parsed tree; a loaded one is compiled as it was
+    // written, and a cached one reports what the passes found then.
+    size_t FirstMessage = Diags.getPending().size();
+    if (Tree && FoldConstants)
     {
-        llvm::errs() << "Semantic errors occurred\n";
-        return 1;
+        ConstFold Folder(Parser->getContext(), Diags);
+        if (Folder.fold(Tree))
+            return fail("Semantic");
     }
+    if (Tree && AnalyzeDefUse)
+        DefUse(Diags).analyze(Tree);
+    for (const DiagnosticsEngine::Diagnostic &D : Cached.Messages)
+        Diags.report(D);
+    if (!EmitAST.empty())
+    {
+        llvm::ArrayRef<DiagnosticsEngine::Diagnostic> Messages =
+            Diags.getPending();
+        Info.Messages.assign(Messages.begin() + FirstMessage, Messages.end());
+    }
+    Diags.flush();
+
+    // Optionally flatten the AST; the pointer tree is not used after this.
+    if (Tree && (UseFlatAST || !EmitAST.empty()))
+    {
+        Flat.emplace(FlatAST::build(Tree, Parser->getContext().getNumNodes()));
+        if (!EmitAST.empty() && Flat->write(EmitAST, Info, llvm::errs()))
+            return 1;
+    }
+    if (Flat && ASTStats)
+        llvm::errs() << "Flat AST: " << Flat->size() << " nodes, "
+                     << Flat->getMemorySize() << " bytes\n";
 
     // Generate code for the AST using a code generator.
-    CodeGen CodeGenerator;
-    CodeGenerator.compile(Tree);
+    CodeGen CodeGenerator(OptLevel, PrintPassTimings, RunProgram);
+    llvm::SmallString<256> Runtime(RuntimeLib);
+    if (Runtime.empty())
+    {
+        static int StaticSymbol;
+        Runtime = llvm::sys::path::parent_path(
+            llvm::sys::fs::getMainExecutable(argv[0], &StaticSymbol));
+        llvm::sys::path::append(Runtime, "libgsmrt.a");
+    }
+    CodeGenerator.setOutput(EmitType, OutputFilename, Runtime);
+    CodeGenerator.setPartitioning(PartitionSize, CodegenThreads);
+    if (Flat ? CodeGenerator.compile(*Flat) : CodeGenerator.compile(Tree))
+        return 1;
 
-    // The program executed successfully.
-    return 0;
+    // The program compiled successfully; with -run, exit as it did.
+    return CodeGenerator.getExitCode();
 }
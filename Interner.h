@@ -0,0 +1,50 @@
+#ifndef INTERNER_H
+#define INTERNER_H
+
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include <cassert>
+#include <vector>
+
+// Interner gives every distinct identifier a dense 32-bit symbol ID, in
+// the order they are first seen. The parser interns names while it builds
+// the tree, so later phases can keep per-variable state in vectors
+// indexed by symbol instead of hashing the name on every use.
+//
+// The table keeps its own copy of each name. It is not locked: while
+// several threads share it, all of them may only call lookup() on names
+// interned before.
+class Interner
+{
+    llvm::StringMap<unsigned> IDs;
+    std::vector<llvm::StringRef> Names; // indexed by symbol, owned by IDs
+
+public:
+    // symbol ID of Name, a new one if Name was not seen before
+    unsigned intern(llvm::StringRef Name)
+    {
+        auto Inserted = IDs.try_emplace(Name, Names.size());
+        if (Inserted.second)
+            Names.push_back(Inserted.first->getKey());
+        return Inserted.first->second;
+    }
+
+    // symbol ID of Name, which must have been interned
+    unsigned lookup(llvm::StringRef Name) const
+    {
+        auto It = IDs.find(Name);
+        assert(It != IDs.end() && "name was not interned");
+        return It->second;
+    }
+
+    llvm::StringRef getName(unsigned Symbol) const
+    {
+        assert(Symbol < Names.size() && "symbol was not interned");
+        return Names[Symbol];
+    }
+
+    // number of symbols, all IDs are below it
+    unsigned size() const { return Names.size(); }
+};
+
+#endif
@@ -0,0 +1,58 @@
+#include "JIT.h"
+#include "Runtime.h"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/TargetSelect.h"
+#include <chrono>
+
+using namespace llvm;
+
+bool JIT::run(std::unique_ptr<LLVMContext> Ctx, std::unique_ptr<Module> M,
+              int &ExitCode)
+{
+    auto Fail = [&](Error E) {
+        Err << "JIT: " << toString(std::move(E)) << '\n';
+        return true;
+    };
+
+    // Compiling covers creating the JIT for the host and generating the
+    // machine code of main, which LLJIT does when main is looked up.
+    auto Start = std::chrono::steady_clock::now();
+    InitializeNativeTarget();
+    InitializeNativeTargetAsmPrinter();
+    auto J = orc::LLJITBuilder().create();
+    if (!J)
+        return Fail(J.takeError());
+
+    orc::MangleAndInterner Mangle((*J)->getExecutionSession(),
+                                  (*J)->getDataLayout());
+    orc::SymbolMap Runtime;
+    Runtime[Mangle("gsm_write")] = JITEvaluatedSymbol(
+        pointerToJITTargetAddress(Write), JITSymbolFlags::Exported);
+    Runtime[Mangle("gsm_pow")] = JITEvaluatedSymbol(
+        pointerToJITTargetAddress(&gsm_pow), JITSymbolFlags::Exported);
+    if (Error E = (*J)->getMainJITDylib().define(
+            orc::absoluteSymbols(std::move(Runtime))))
+        return Fail(std::move(E));
+
+    if (Error E = (*J)->addIRModule(
+            orc::ThreadSafeModule(std::move(M), std::move(Ctx))))
+        return Fail(std::move(E));
+    auto Main = (*J)->lookup("main");
+    if (!Main)
+        return Fail(Main.takeError());
+    auto *MainFn = jitTargetAddressToFunction<int (*)(int, char **)>(
+        Main->getAddress());
+    std::chrono::duration<double> Elapsed =
+        std::chrono::steady_clock::now() - Start;
+    CompileTime = Elapsed.count();
+
+    char Name[] = "gsm";
+    char *Argv[] = {Name, nullptr};
+    Start = std::chrono::steady_clock::now();
+    ExitCode = MainFn(1, Argv);
+    Elapsed = std::chrono::steady_clock::now() - Start;
+    RunTime = Elapsed.count();
+    return false;
+}
@@ -0,0 +1,38 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include "Runtime.h"
+#include "llvm/Support/raw_ostream.h"
+#include <memory>
+
+namespace llvm
+{
+  class LLVMContext;
+  class Module;
+}
+
+// JIT runs the main function of a module in-process with ORC's LLJIT,
+// rather than printing the IR for llc and a separately linked runtime. The
+// calls to gsm_write and gsm_pow are resolved to the functions of
+// Runtime.cpp in gsm itself, or gsm_write to a function given instead.
+class JIT
+{
+    llvm::raw_ostream &Err;
+    void (*Write)(int); // what the calls to gsm_write are resolved to
+    double CompileTime; // seconds to create the JIT and compile the module
+    double RunTime;     // seconds main ran for
+
+public:
+    JIT(llvm::raw_ostream &Err, void (*Write)(int) = gsm_write)
+        : Err(Err), Write(Write), CompileTime(0), RunTime(0) {}
+
+    // compiles M and runs its main, whose result is stored in ExitCode;
+    // returns true if M could not be compiled
+    bool run(std::unique_ptr<llvm::LLVMContext> Ctx,
+             std::unique_ptr<llvm::Module> M, int &ExitCode);
+
+    double getCompileTime() const { return CompileTime; }
+    double getRunTime() const { return RunTime; }
+};
+
+#endif
@@ -1,4 +1,12 @@
 #include "Lexer.h"
+#include "llvm/Support/MathExtras.h"
+#include <cstdint>
+#include <cstring>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define LEXER_HAS_X86_SCANNERS 1
+#include <immintrin.h>
+#endif
 
 // classifying characters
 namespace charinfo
@@ -19,13 +27,269 @@ namespace charinfo
     {
         return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
     }
+
+    // the character classes that form runs inside a token or between tokens
+    enum CharClass
+    {
+        Whitespace,
+        Letter,
+        Digit
+    };
+
+    template <CharClass C>
+    LLVM_READNONE inline bool is(char c)
+    {
+        return C == Whitespace ? isWhitespace(c)
+                               : C == Letter ? isLetter(c) : isDigit(c);
+    }
+
+    // returns the first character in [Ptr, End) that is not of class C
+    template <CharClass C>
+    inline const char *scanScalar(const char *Ptr, const char *End)
+    {
+        while (Ptr != End && is<C>(*Ptr))
+            ++Ptr;
+        return Ptr;
+    }
+
+#ifdef LEXER_HAS_X86_SCANNERS
+    // Vector scanners. Each byte of the input is tested against the class
+    // with signed compares: bytes >= 0x80 are negative and thus never match,
+    // just like in the scalar predicates. Only full vectors that lie before
+    // End are loaded, the remaining tail is handled by scanScalar.
+
+    template <CharClass C>
+    __attribute__((target("sse2"))) inline __m128i classifySSE2(__m128i V)
+    {
+        if (C == Whitespace)
+        {
+            // ' ' or '\t', '\n', '\v', '\f', '\r' (9 to 13)
+            __m128i Space = _mm_cmpeq_epi8(V, _mm_set1_epi8(' '));
+            __m128i Ctrl = _mm_and_si128(_mm_cmpgt_epi8(V, _mm_set1_epi8(8)),
+                                         _mm_cmplt_epi8(V, _mm_set1_epi8(14)));
+            return _mm_or_si128(Space, Ctrl);
+        }
+        if (C == Letter)
+        {
+            // setting bit 5 folds 'A'-'Z' onto 'a'-'z' and nothing else onto it
+            V = _mm_or_si128(V, _mm_set1_epi8(0x20));
+            return _mm_and_si128(_mm_cmpgt_epi8(V, _mm_set1_epi8('a' - 1)),
+                                 _mm_cmplt_epi8(V, _mm_set1_epi8('z' + 1)));
+        }
+        return _mm_and_si128(_mm_cmpgt_epi8(V, _mm_set1_epi8('0' - 1)),
+                             _mm_cmplt_epi8(V, _mm_set1_epi8('9' + 1)));
+    }
+
+    template <CharClass C>
+    __attribute__((target("sse2"))) const char *scanSSE2(const char *Ptr,
+                                                          const char *End)
+    {
+        while (End - Ptr >= 16)
+        {
+            __m128i V = _mm_loadu_si128(reinterpret_cast<const __m128i *>(Ptr));
+            unsigned Miss = ~_mm_movemask_epi8(classifySSE2<C>(V)) & 0xFFFFu;
+            if (Miss)
+                return Ptr + llvm::countTrailingZeros(Miss);
+            Ptr += 16;
+        }
+        return scanScalar<C>(Ptr, End);
+    }
+
+    template <CharClass C>
+    __attribute__((target("avx2"))) inline __m256i classifyAVX2(__m256i V)
+    {
+        if (C == Whitespace)
+        {
+            __m256i Space = _mm256_cmpeq_epi8(V, _mm256_set1_epi8(' '));
+            __m256i Ctrl =
+                _mm256_and_si256(_mm256_cmpgt_epi8(V, _mm256_set1_epi8(8)),
+                                 _mm256_cmpgt_epi8(_mm256_set1_epi8(14), V));
+            return _mm256_or_si256(Space, Ctrl);
+        }
+        if (C == Letter)
+        {
+            V = _mm256_or_si256(V, _mm256_set1_epi8(0x20));
+            return _mm256_and_si256(
+                _mm256_cmpgt_epi8(V, _mm256_set1_epi8('a' - 1)),
+                _mm256_cmpgt_epi8(_mm256_set1_epi8('z' + 1), V));
+        }
+        return _mm256_and_si256(_mm256_cmpgt_epi8(V, _mm256_set1_epi8('0' - 1)),
+                                _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), V));
+    }
+
+    template <CharClass C>
+    __attribute__((target("avx2"))) const char *scanAVX2(const char *Ptr,
+                                                          const char *End)
+    {
+        while (End - Ptr >= 32)
+        {
+            __m256i V =
+                _mm256_loadu_si256(reinterpret_cast<const __m256i *>(Ptr));
+            unsigned Miss = ~static_cast<unsigned>(
+                _mm256_movemask_epi8(classifyAVX2<C>(V)));
+            if (Miss)
+                return Ptr + llvm::countTrailingZeros(Miss);
+            Ptr += 32;
+        }
+        return scanSSE2<C>(Ptr, End);
+    }
+#endif
+}
+
+// skips the run of class C characters starting at Ptr
+template <charinfo::CharClass C>
+static const char *scanRun(Lexer::ScanKind Kind, const char *Ptr,
+                           const char *End)
+{
+    switch (Kind)
+    {
+#ifdef LEXER_HAS_X86_SCANNERS
+    case Lexer::AVX2:
+        return charinfo::scanAVX2<C>(Ptr, End);
+    case Lexer::SSE2:
+        return charinfo::scanSSE2<C>(Ptr, End);
+#endif
+    default:
+        return charinfo::scanScalar<C>(Ptr, End);
+    }
+}
+
+Lexer::ScanKind Lexer::getBestScanKind()
+{
+#ifdef LEXER_HAS_X86_SCANNERS
+    static const ScanKind Best = __builtin_cpu_supports("avx2")   ? AVX2
+                                 : __builtin_cpu_supports("sse2") ? SSE2
+                                                                  : Scalar;
+    return Best;
+#else
+    return Scalar;
+#endif
+}
+
+// Keywords are found with a perfect hash of the length and the first and
+// last character, so classifying an identifier costs one table probe and
+// at most one string compare. The table is generated at compile time and
+// the build fails if a new keyword introduces a collision.
+namespace
+{
+    struct Keyword
+    {
+        const char *Spelling;
+        unsigned Length;
+        Token::TokenKind Kind;
+    };
+
+    constexpr unsigned length(const char *S)
+    {
+        return *S ? 1 + length(S + 1) : 0;
+    }
+
+    constexpr Keyword makeKeyword(const char *Spelling, Token::TokenKind Kind)
+    {
+        return Keyword{Spelling, length(Spelling), Kind};
+    }
+
+    // KW_type has no spelling of its own, `int` is the only type name
+    constexpr Keyword Keywords[] = {
+        makeKeyword("int", Token::KW_int),
+        makeKeyword("if", Token::KW_if),
+        makeKeyword("elif", Token::KW_elif),
+        makeKeyword("else", Token::KW_else),
+        makeKeyword("loopc", Token::KW_loopc),
+        makeKeyword("begin", Token::KW_begin),
+        makeKeyword("end", Token::KW_end),
+        makeKeyword("and", Token::KW_and),
+        makeKeyword("or", Token::KW_or),
+    };
+
+    constexpr unsigned NumKeywords = sizeof(Keywords) / sizeof(Keywords[0]);
+    constexpr unsigned KeywordTableSize = 16; // must be a power of two
+
+    constexpr unsigned hashKeyword(unsigned Length, char First, char Last)
+    {
+        return (Length + static_cast<unsigned char>(First) +
+                static_cast<unsigned char>(Last)) &
+               (KeywordTableSize - 1);
+    }
+
+    struct KeywordTable
+    {
+        unsigned char Slots[KeywordTableSize]; // index into Keywords + 1, 0 if empty
+        bool IsPerfect;
+    };
+
+    constexpr KeywordTable buildKeywordTable()
+    {
+        KeywordTable Table{};
+        Table.IsPerfect = true;
+        for (unsigned I = 0; I < NumKeywords; ++I)
+        {
+            const Keyword &K = Keywords[I];
+            unsigned Hash =
+                hashKeyword(K.Length, K.Spelling[0], K.Spelling[K.Length - 1]);
+            if (Table.Slots[Hash])
+                Table.IsPerfect = false;
+            Table.Slots[Hash] = I + 1;
+        }
+        return Table;
+    }
+
+    constexpr KeywordTable KeywordSlots = buildKeywordTable();
+    static_assert(KeywordSlots.IsPerfect,
+                  "keyword hash collides, change hashKeyword or the table size");
+
+    constexpr bool hasComparableLengths()
+    {
+        for (unsigned I = 0; I < NumKeywords; ++I)
+            if (Keywords[I].Length < 2 || Keywords[I].Length > 8)
+                return false;
+        return true;
+    }
+    static_assert(hasComparableLengths(),
+                  "getKeywordKind compares keywords of 2 to 8 characters");
+
+    template <typename T>
+    inline T load(const char *Ptr)
+    {
+        T Value;
+        std::memcpy(&Value, Ptr, sizeof(T));
+        return Value;
+    }
+}
+
+Token::TokenKind Lexer::getKeywordKind(llvm::StringRef Name)
+{
+    if (Name.empty())
+        return Token::id;
+    unsigned Slot =
+        KeywordSlots.Slots[hashKeyword(Name.size(), Name.front(), Name.back())];
+    if (!Slot)
+        return Token::id;
+    const Keyword &K = Keywords[Slot - 1];
+    if (K.Length != Name.size())
+        return Token::id;
+    // keywords are 2 to 8 bytes long, so two overlapping loads of the first
+    // and last bytes compare them without a loop or a memcmp call
+    const char *S = Name.data();
+    bool Equal = K.Length < 4
+                     ? load<uint16_t>(S) == load<uint16_t>(K.Spelling) &&
+                           load<uint16_t>(S + K.Length - 2) ==
+                               load<uint16_t>(K.Spelling + K.Length - 2)
+                     : load<uint32_t>(S) == load<uint32_t>(K.Spelling) &&
+                           load<uint32_t>(S + K.Length - 4) ==
+                               load<uint32_t>(K.Spelling + K.Length - 4);
+    return Equal ? K.Kind : Token::id;
 }
 
 void Lexer::next(Token &token)
 {
-    while (*BufferPtr && charinfo::isWhitespace(*BufferPtr))
+    // a whitespace run that reaches the end of the window may go on in the
+    // next chunk of a streamed input
+    for (;;)
     {
-        ++BufferPtr;
+        BufferPtr = scanRun<charinfo::Whitespace>(Scan, BufferPtr, BufferEnd);
+        if (BufferPtr != BufferEnd || !refill())
+            break;
     }
     // make sure we didn't reach the end of input
     if (!*BufferPtr)
@@ -36,31 +300,44 @@ void Lexer::next(Token &token)
     // collect characters and check for keywords or ident
     if (charinfo::isLetter(*BufferPtr))
     {
-        const char *end = BufferPtr + 1;
-        while (charinfo::isLetter(*end))
-            ++end;
+        const char *end =
+            scanRun<charinfo::Letter>(Scan, BufferPtr + 1, BufferEnd);
+        while (end == BufferEnd)
+        {
+            // refill() moves the window even if it finds no more input
+            size_t Len = end - BufferPtr;
+            bool More = refill();
+            end = scanRun<charinfo::Letter>(Scan, BufferPtr + Len, BufferEnd);
+            if (!More)
+                break;
+        }
         llvm::StringRef Name(BufferPtr, end - BufferPtr);
-        Token::TokenKind kind;
-        
-        if (Name == "int")
-            kind = Token::KW_int;
-        else
-            kind = Token::id;
         // generate the token
-        formToken(token, end, kind);
+        formToken(token, end, getKeywordKind(Name));
         return;
     }
     // check for numbers
     else if (charinfo::isDigit(*BufferPtr))
     {
-        const char *end = BufferPtr + 1;
-        while (charinfo::isDigit(*end))
-            ++end;
+        const char *end =
+            scanRun<charinfo::Digit>(Scan, BufferPtr + 1, BufferEnd);
+        while (end == BufferEnd)
+        {
+            // refill() moves the window even if it finds no more input
+            size_t Len = end - BufferPtr;
+            bool More = refill();
+            end = scanRun<charinfo::Digit>(Scan, BufferPtr + Len, BufferEnd);
+            if (!More)
+                break;
+        }
         formToken(token, end, Token::num);
         return;
     }
     else
     {
+        // operators look one character ahead
+        if (BufferPtr + 1 == BufferEnd)
+            refill();
         if (*BufferPtr == '+' && *(BufferPtr+1) == '=')
             formToken(token, BufferPtr + 2, Token::KW_plusEqual);
         else if (*BufferPtr == '-' && *(BufferPtr+1) == '=')
@@ -109,6 +386,8 @@ void Lexer::next(Token &token)
             formToken(token, BufferPtr + 1, Token::KW_lessThan);
         else if (*BufferPtr == ':')
             formToken(token, BufferPtr + 1, Token::KW_colon);
+        else
+            formToken(token, BufferPtr + 1, Token::unknown);
         return;
         /*switch (*BufferPtr)
         {
@@ -138,5 +417,69 @@ void Lexer::formToken(Token &Tok, const char *TokEnd,
 {
     Tok.Kind = Kind;
     Tok.Text = llvm::StringRef(BufferPtr, TokEnd - BufferPtr);
+    // the window of a streamed input is reused, so the texts the AST keeps,
+    // names, literals and the keywords statements are located by, must
+    // outlive it; the text of any other token is valid until next()
+    if (isStreaming() && Tok.isOneOf(Token::id, Token::num, Token::KW_if,
+                                     Token::KW_elif, Token::KW_loopc))
+        Tok.Text = saveText(Tok.Text);
     BufferPtr = TokEnd;
 }
+
+// Copies Text out of the window of a streamed input, behind the offset it
+// has in the input, which getOffset() reads back.
+llvm::StringRef Lexer::saveText(llvm::StringRef Text)
+{
+    uint64_t Offset = WindowOffset + (Text.data() - Chunk.data());
+    char *Mem = static_cast<char *>(
+        TextAlloc.Allocate(sizeof(Offset) + Text.size() + 1, 1));
+    std::memcpy(Mem, &Offset, sizeof(Offset));
+    std::memcpy(Mem + sizeof(Offset), Text.data(), Text.size());
+    Mem[sizeof(Offset) + Text.size()] = '\0';
+    return llvm::StringRef(Mem + sizeof(Offset), Text.size());
+}
+
+uint64_t Lexer::getOffset(const char *Loc)
+{
+    if (!isStreaming())
+        return ~uint64_t(0);
+    if (Loc >= Chunk.data() && Loc <= BufferEnd)
+        return WindowOffset + (Loc - Chunk.data());
+    if (!TextAlloc.identifyObject(Loc))
+        return ~uint64_t(0);
+    uint64_t Offset;
+    std::memcpy(&Offset, Loc - sizeof(Offset), sizeof(Offset));
+    return Offset;
+}
+
+// Makes more of a streamed input available when a token reaches the end of
+// the window. The consumed part of the window is dropped and the rest moved
+// to its front, so the window only grows past ChunkSize for a single token
+// longer than that. Returns false if no more input could be read; a read
+// error ends the input too, and is kept for getReadError().
+bool Lexer::refill()
+{
+    if (!isStreaming() || AtEOF)
+        return false;
+
+    size_t Keep = BufferEnd - BufferPtr;
+    WindowOffset += BufferPtr - Chunk.data();
+    std::memmove(Chunk.data(), BufferPtr, Keep);
+    if (Chunk.size() < Keep + ChunkSize + 1)
+        Chunk.resize(Keep + ChunkSize + 1);
+
+    size_t Read = 0;
+    llvm::Expected<size_t> ReadOrErr = llvm::sys::fs::readNativeFile(
+        File, llvm::makeMutableArrayRef(Chunk.data() + Keep, ChunkSize));
+    if (ReadOrErr)
+        Read = *ReadOrErr;
+    else
+        ReadError = llvm::toString(ReadOrErr.takeError());
+    if (!Read)
+        AtEOF = true;
+
+    BufferStart = BufferPtr = Chunk.data();
+    BufferEnd = BufferStart + Keep + Read;
+    Chunk[Keep + Read] = '\0';
+    return Read != 0;
+}
@@ -1,14 +1,20 @@
 #ifndef LEXER_H // conditional compilations(checks whether a macro is not defined)
 #define LEXER_H
 
+#include "llvm/ADT/SmallVector.h"
 #include "llvm/ADT/StringRef.h"        // encapsulates a pointer to a C string and its length
+#include "llvm/Support/Allocator.h"
+#include "llvm/Support/FileSystem.h"   // native file handles for streamed input
 #include "llvm/Support/MemoryBuffer.h" // read-only access to a block of memory, filled with the content of a file
+#include <string>
 
 class Lexer;
+class TokenStream;
 
 class Token
 {
-    friend class Lexer; // Lexer can access private and protected members of Token
+    friend class Lexer;       // Lexer can access private and protected members of Token
+    friend class TokenStream; // so can the pre-lexed token stream
 
 public:
     enum TokenKind : unsigned short
@@ -90,19 +96,79 @@ public:
 
 class Lexer
 {
+public:
+    // implementation used to scan runs of whitespace, letters and digits
+    enum ScanKind
+    {
+        Scalar, // one byte at a time
+        SSE2,   // 16 bytes at a time
+        AVX2    // 32 bytes at a time
+    };
+
+private:
     const char *BufferStart; // pointer to the beginning of the input
     const char *BufferPtr;   // pointer to the next unprocessed character
+    const char *BufferEnd;   // pointer to the terminating NUL of the input
+    ScanKind Scan;           // scanner used for character runs
+
+    // state of a streaming lexer; the buffer is then a window of the input
+    llvm::sys::fs::file_t File;      // input to stream from, or kInvalidFile
+    size_t ChunkSize;                // bytes read from File at a time
+    bool AtEOF;                      // File has no more data
+    llvm::SmallVector<char, 0> Chunk; // storage of the window
+    uint64_t WindowOffset;            // offset in the input of the window
+    llvm::BumpPtrAllocator TextAlloc; // texts the AST keeps, see saveText
+    std::string ReadError;            // why File could not be read, if so
 
 public:
-    Lexer(const llvm::StringRef &Buffer)
+    // the buffer must be NUL-terminated, i.e. *Buffer.end() == 0
+    Lexer(const llvm::StringRef &Buffer, ScanKind Scan = getBestScanKind())
+        : Scan(Scan), File(llvm::sys::fs::kInvalidFile), ChunkSize(0),
+          AtEOF(true), WindowOffset(0)
     {
         BufferStart = Buffer.begin();
         BufferPtr = BufferStart;
+        BufferEnd = Buffer.end();
+    }
+
+    // streams the input from File, reading ChunkSize bytes at a time as
+    // tokens are requested, so parsing starts before the input is complete;
+    // the texts of identifiers and numbers are copied out of the window
+    Lexer(llvm::sys::fs::file_t File, size_t ChunkSize,
+          ScanKind Scan = getBestScanKind())
+        : Scan(Scan), File(File), ChunkSize(ChunkSize ? ChunkSize : 1),
+          AtEOF(false), WindowOffset(0)
+    {
+        Chunk.push_back('\0');
+        BufferStart = BufferPtr = Chunk.data();
+        BufferEnd = BufferStart;
     }
 
+    Lexer(const Lexer &) = delete;
+    Lexer &operator=(const Lexer &) = delete;
+
     void next(Token &token); // return the next token
 
+    // widest scanner supported by the host CPU, detected once at runtime
+    static ScanKind getBestScanKind();
+
+    // keyword kind of an identifier, or Token::id if it is not a keyword
+    static Token::TokenKind getKeywordKind(llvm::StringRef Name);
+
+    // a streamed input ends at a read error, which the tokens do not show;
+    // the caller reports it and must not compile what was read
+    bool hasReadError() const { return !ReadError.empty(); }
+    llvm::StringRef getReadError() const { return ReadError; }
+
+    // offset in a streamed input of Loc, the text of the current token or
+    // one the AST keeps, or ~0 if Loc is neither; diagnostics are located
+    // by it, as the input is not in one buffer
+    uint64_t getOffset(const char *Loc);
+
 private:
     void formToken(Token &Result, const char *TokEnd, Token::TokenKind Kind);
+    bool isStreaming() const { return File != llvm::sys::fs::kInvalidFile; }
+    bool refill();
+    llvm::StringRef saveText(llvm::StringRef Text);
 };
 #endif
\ No newline at end of file
@@ -1,4 +1,115 @@
 #include "Parser.h"
+#include "ASTWalker.h"
+#include "llvm/Support/ThreadPool.h"
+
+namespace
+{
+    // binding strength of the binary operators, from loosest to tightest
+    enum Precedence : unsigned char
+    {
+        PrecNone,           // not a binary operator
+        PrecLogical,        // and, or
+        PrecRelational,     // ==, !=, <, <=, >, >=
+        PrecAdditive,       // +, -
+        PrecMultiplicative, // *, /, %
+        PrecPower           // ^
+    };
+
+    // which node an operator token builds
+    enum OperatorClass : unsigned char
+    {
+        NotAnOperator,
+        Arithmetic,    // BinaryOp
+        Relational,    // Condition
+        Logical,       // Conditions
+        Assign,        // = of an Equation
+        CompoundAssign // +=, -=, ... of an Equation, a BinaryOp on the right
+    };
+
+    struct OperatorInfo
+    {
+        unsigned char Prec;  // Precedence
+        unsigned char Class; // OperatorClass
+        unsigned char Op;    // BinaryOp::Operator, Condition::OperatorCondition
+                             // or Conditions::andOr, depending on Class
+    };
+
+    constexpr unsigned NumTokenKinds = Token::KW_colon + 1;
+
+    struct OperatorTable
+    {
+        OperatorInfo Ops[NumTokenKinds];
+    };
+
+    constexpr OperatorInfo makeOperator(Precedence Prec, OperatorClass Class,
+                                        unsigned Op)
+    {
+        return OperatorInfo{Prec, Class, static_cast<unsigned char>(Op)};
+    }
+
+    // the token to operator mapping, indexed by Token::TokenKind
+    constexpr OperatorTable buildOperatorTable()
+    {
+        OperatorTable T{};
+        T.Ops[Token::KW_and] = makeOperator(PrecLogical, Logical, Conditions::KW_and);
+        T.Ops[Token::KW_or] = makeOperator(PrecLogical, Logical, Conditions::KW_or);
+        T.Ops[Token::KW_EqEq] = makeOperator(PrecRelational, Relational, Condition::KW_EqEq);
+        T.Ops[Token::KW_eqNot] = makeOperator(PrecRelational, Relational, Condition::KW_eqNot);
+        T.Ops[Token::KW_lessThan] = makeOperator(PrecRelational, Relational, Condition::KW_lessThan);
+        T.Ops[Token::KW_lessEqual] = makeOperator(PrecRelational, Relational, Condition::KW_lessEqual);
+        T.Ops[Token::KW_greaterThan] = makeOperator(PrecRelational, Relational, Condition::KW_greaterThan);
+        T.Ops[Token::KW_greaterEqual] = makeOperator(PrecRelational, Relational, Condition::KW_greaterEqual);
+        T.Ops[Token::plus] = makeOperator(PrecAdditive, Arithmetic, BinaryOp::Plus);
+        T.Ops[Token::minus] = makeOperator(PrecAdditive, Arithmetic, BinaryOp::Minus);
+        T.Ops[Token::star] = makeOperator(PrecMultiplicative, Arithmetic, BinaryOp::star);
+        T.Ops[Token::slash] = makeOperator(PrecMultiplicative, Arithmetic, BinaryOp::slash);
+        T.Ops[Token::KW_mod] = makeOperator(PrecMultiplicative, Arithmetic, BinaryOp::KW_mod);
+        T.Ops[Token::power] = makeOperator(PrecPower, Arithmetic, BinaryOp::power);
+        T.Ops[Token::equal] = makeOperator(PrecNone, Assign, 0);
+        T.Ops[Token::KW_plusEqual] = makeOperator(PrecNone, CompoundAssign, BinaryOp::Plus);
+        T.Ops[Token::KW_minusEqual] = makeOperator(PrecNone, CompoundAssign, BinaryOp::Minus);
+        T.Ops[Token::KW_starEqual] = makeOperator(PrecNone, CompoundAssign, BinaryOp::star);
+        T.Ops[Token::KW_slashEqual] = makeOperator(PrecNone, CompoundAssign, BinaryOp::slash);
+        T.Ops[Token::KW_modEq] = makeOperator(PrecNone, CompoundAssign, BinaryOp::KW_mod);
+        T.Ops[Token::KW_poEq] = makeOperator(PrecNone, CompoundAssign, BinaryOp::power);
+        return T;
+    }
+
+    constexpr OperatorTable Operators = buildOperatorTable();
+
+    inline const OperatorInfo &getOperatorInfo(Token::TokenKind Kind)
+    {
+        return Operators.Ops[Kind];
+    }
+
+    // unifies the expressions of statements parsed in sub-contexts with
+    // the tables of Context, see ASTContext::unify(); the statements
+    // themselves and the targets of equations are never shared
+    class ChunkUnifier : public RecursiveASTWalker<ChunkUnifier>
+    {
+        ASTContext &Context;
+        llvm::DenseMap<Expr *, Expr *> Unified;
+
+    public:
+        ChunkUnifier(ASTContext &Context) : Context(Context) {}
+
+        void walkEquation(Equation &Node)
+        {
+            Node.setRight(Context.unify(Node.getRight(), Unified));
+        }
+
+        void walkDeclaration(Declaration &Node)
+        {
+            if (Node.getExpr())
+                Node.setExpr(Context.unify(Node.getExpr(), Unified));
+        }
+
+        // conditions are not shared, only their operands
+        void walkConditions(Conditions &Node) { Context.unify(&Node, Unified); }
+
+        void walkCondition(Condition &Node) { Context.unify(&Node, Unified); }
+    };
+}
 
 // main point is that the whole input has been consumed
 AST *Parser::parse()
@@ -7,100 +118,223 @@ AST *Parser::parse()
     return Res;
 }
 
-AST *Parser::parseGSM()
+// Syntax errors are recovered from per statement, so one compile reports
+// every error: the broken statement is dropped, the input is skipped up to
+// a point where parsing can resume, and the statements around it still
+// end up in the tree.
+//
+// The resume points are the ';' ending a declaration or equation (which is
+// consumed), the 'end' closing a body, and the keywords that start a
+// statement. Once the error limit is reached the rest of the input is
+// skipped.
+void Parser::synchronize()
 {
-    llvm::SmallVector<Expr *> exprs;
-    while (!Tok.is(Token::eoi))
+    if (Diags.hasReachedErrorLimit())
+    {
+        while (!Tok.is(Token::eoi))
+            advance();
+        return;
+    }
+    for (;;)
     {
         switch (Tok.getKind())
         {
+        case Token::eoi:
+        case Token::KW_end:
         case Token::KW_int:
-            Expr *d1;
-            d1 = parseDec();
-            if (d1)
-                exprs.push_back(d1);
-            else
-                goto _error2;
+        case Token::KW_if:
+        case Token::KW_loopc:
+            return;
+        case Token::semicolon:
+            advance();
+            return;
+        default:
+            advance();
             break;
+        }
+    }
+}
 
-            if (!Tok.is(Token::semicolon))
-            {
-                error();
-                goto _error2;
-            }
+// After an error in the header of an if, elif, else or loopc, skips to
+// its body so that the body is consumed as a whole instead of being taken
+// for top-level statements. Returns false if there is no body to resume at.
+bool Parser::skipToBody()
+{
+    while (!Tok.isOneOf(Token::KW_colon, Token::KW_begin, Token::semicolon,
+                        Token::KW_end, Token::KW_int, Token::KW_if,
+                        Token::KW_loopc, Token::eoi))
+        advance();
+    return Tok.isOneOf(Token::KW_colon, Token::KW_begin);
+}
 
-        case Token::id:
-            Expr *d2;
-            d2 = parseEquation();
-            if (d2)
-                exprs.push_back(d2);
-            else
-                goto _error2;
-            break;
+GSM *Parser::parseGSM()
+{
+    llvm::SmallVector<Expr *> exprs;
+    parseStatements(exprs);
+    return Context.create<GSM>(exprs);
+}
 
-            if (!Tok.is(Token::semicolon))
-            {
-                error();
-                goto _error2;
-            }
+void Parser::parseStatements(llvm::SmallVectorImpl<Expr *> &Statements)
+{
+    while (!Tok.is(Token::eoi))
+    {
+        Expr *Statement = parseStatement();
+        if (Statement)
+            Statements.push_back(Statement);
+    }
+}
 
-        case Token::KW_loopc:
-            Expr *d3;
-            d3 = parseLoop();
-            if (d3)
-                exprs.push_back(d3);
-            else
-                goto _error2;
+// Top-level statements do not depend on each other syntactically, so once
+// their boundaries are known they can be parsed independently. A quick scan
+// over the token kinds finds the boundaries: a ';' outside any body, or the
+// 'end' that closes the last body of an if (not followed by elif or else)
+// or loopc. The same scan interns the identifiers in the order of their
+// tokens, which is the order parse() interns them in, so the symbol IDs do
+// not depend on how the threads are scheduled. The statements are grouped
+// into a few chunks per thread, each chunk is parsed into its own arena by
+// a thread pool and the results are joined in source order. The chunks
+// only look the names up, so the table is not changed while they run.
+// With hash-consing, each chunk shares expressions within itself; the
+// joined statements are then unified with the tables of the main context,
+// which shares them across chunks as parse() would.
+//
+// The boundaries of a broken program need not match the statements the
+// serial parser would recover, so if any chunk has a syntax error the
+// input is parsed again serially; errors are then reported exactly as by
+// parse().
+AST *Parser::parseParallel(unsigned NumThreads)
+{
+    assert(Stream && Index == 1 && "parallel parsing needs a fresh token stream");
+    if (NumThreads <= 1)
+        return parse();
+
+    // the index after the last token of every top-level statement
+    llvm::SmallVector<unsigned, 0> Boundaries;
+    unsigned Depth = 0;
+    for (unsigned I = 0; I < End; ++I)
+    {
+        switch (Stream->getKind(I))
+        {
+        case Token::KW_begin:
+            ++Depth;
             break;
-
-            /*if (!Tok.is(Token::semicolon))
-            {
-                error();
-                goto _error2;
-            }*/
-        case Token::KW_if:
-            Expr *d4;
-            d4 = parseIf();
-            if (d4)
-                exprs.push_back(d4);
-            else
-                goto _error2;
+        case Token::KW_end:
+            if (Depth)
+                --Depth;
+            if (!Depth && Stream->getKind(I + 1) != Token::KW_elif &&
+                Stream->getKind(I + 1) != Token::KW_else)
+                Boundaries.push_back(I + 1);
+            break;
+        case Token::semicolon:
+            if (!Depth)
+                Boundaries.push_back(I + 1);
+            break;
+        case Token::id:
+            Context.intern(Stream->getText(I));
             break;
-
-            // if (!Tok.is(Token::semicolon))
-            // {
-            //     error();
-            //     goto _error2;
-            // }
         default:
-            goto _error2;
             break;
         }
-        advance(); // TODO: watch this part
     }
-    return new NAN(exprs);
-_error2:
-    while (Tok.getKind() != Token::eoi)
+
+    struct Chunk
+    {
+        unsigned Begin, End;
+        ASTContext *Context;
+        llvm::SmallVector<Expr *, 0> Statements;
+        bool HasError;
+    };
+    std::vector<Chunk> Chunks;
+    unsigned NumTokens = End - 1; // all but the eoi
+    unsigned TargetSize = NumTokens / (NumThreads * 4) + 1;
+    unsigned ChunkBegin = 0;
+    for (unsigned Boundary : Boundaries)
+        if (Boundary - ChunkBegin >= TargetSize || Boundary == NumTokens)
+        {
+            Chunks.push_back(Chunk{ChunkBegin, Boundary,
+                                   &Context.createSubContext(), {}, false});
+            ChunkBegin = Boundary;
+        }
+    // tokens after the last statement, they are an error
+    if (ChunkBegin != NumTokens)
+    {
+        Context.releaseSubContexts();
+        return parse();
+    }
+
+    llvm::ThreadPool Pool(llvm::hardware_concurrency(NumThreads));
+    for (Chunk &C : Chunks)
+        Pool.async([this, &C] {
+            DiagnosticsEngine Discard(llvm::nulls());
+            Parser P(*Stream, C.Begin, C.End, *C.Context, Discard);
+            P.parseStatements(C.Statements);
+            C.HasError = P.hasError();
+        });
+    Pool.wait();
+
+    llvm::SmallVector<Expr *> exprs;
+    for (Chunk &C : Chunks)
+    {
+        if (C.HasError)
+        {
+            Context.releaseSubContexts();
+            return parse();
+        }
+        exprs.append(C.Statements.begin(), C.Statements.end());
+    }
+
+    if (Context.isHashConsing())
+    {
+        ChunkUnifier Unifier(Context);
+        for (Expr *Statement : exprs)
+            Unifier.walk(Statement);
+    }
+
+    // the serial parser would now stand at the end of the input
+    Index = End;
+    advance();
+    return Context.create<GSM>(exprs);
+}
+
+Expr *Parser::parseStatement()
+{
+    switch (Tok.getKind())
+    {
+    case Token::KW_int:
+        return parseDec();
+    case Token::id:
+        return parseEquation();
+    case Token::KW_loopc:
+        return parseLoop();
+    case Token::KW_if:
+        return parseIf();
+    case Token::KW_end:
+        // a stray 'end' is a resume point by itself
+        error();
         advance();
-    return nullptr;
+        return nullptr;
+    default:
+        error();
+        advance();
+        synchronize();
+        return nullptr;
+    }
 }
 
-Expr *Parser::parseDec()
+Declaration *Parser::parseDec()
 {
-    Expr *E;
+    Expr *E = nullptr;
     llvm::SmallVector<llvm::StringRef, 8> Vars;
-    if (!Tok.is(Token::KW_int) && !(Tok.is(Token::id)))
-        goto _error;
+    llvm::SmallVector<unsigned, 8> Syms;
 
-    advance();
     if (expect(Token::KW_int))
         goto _error;
-
     advance();
 
     if (expect(Token::id))
         goto _error;
     Vars.push_back(Tok.getText());
+    Syms.push_back(Context.intern(Tok.getText()));
     advance();
 
     while (Tok.is(Token::comma))
@@ -109,154 +343,196 @@ Expr *Parser::parseDec()
         if (expect(Token::id))
             goto _error;
         Vars.push_back(Tok.getText());
+        Syms.push_back(Context.intern(Tok.getText()));
         advance();
     }
-    
 
     if (Tok.is(Token::equal))
     {
         advance();
         E = parseExpr();
+        if (!E)
+            goto _error;
     }
 
-    if (expect(Token::semicolon))
+    if (consume(Token::semicolon))
         goto _error;
 
-    return new Declaration(Vars, E);
-_error: // TODO: Check this later in case of error :)
-    while (Tok.getKind() != Token::eoi)
-        advance();
+    return Context.create<Declaration>(Vars, Syms, E);
+_error:
+    synchronize();
     return nullptr;
 }
 
-Expr *Parser::parseEquation()
+Equation *Parser::parseEquation()
 {
+    Final *Left;
     Expr *E;
-    BinaryOp::Operator Op;
+    const OperatorInfo *Info;
 
-    if (!Tok.is(Token::id) /*&& !Tok.is(Token::num) && !Tok.is(Token::l_paren)*/)
-    {
-        // error();
-        // return nullptr;
+    if (expect(Token::id))
         goto _error;
-    }
-
-    advance();           // id += 2;
-    
-    //Fi = parseFinal();
-
-
-    while (Tok.isOneOf(Token::plus, Token::minus , Token::equal, Token::power, Token::star, Token::slash , Token::KW_mod, Token::KW_plusEqual, Token::KW_minusEqual ,Token::KW_starEqual ,Token::KW_slashEqual , Token::KW_modEq)){
-        
-            //Tok.is(Token::star) ? BinaryOp::star : BinaryOp::slash;
-            if (Tok.is(Token::plus)) 
-                Op = BinaryOp::Operator::Plus;
-            else if (Tok.is(Token::minus))  
-                Op =  BinaryOp::Operator::Minus;
-            else if (Tok.is(Token::equal))  
-                Op =  BinaryOp::Operator::equal;
-            else if (Tok.is(Token::power))  
-                Op =  BinaryOp::Operator::power;
-            else if (Tok.is(Token::star))  
-                Op =  BinaryOp::Operator::star;
-            else if (Tok.is(Token::slash))  
-                Op =  BinaryOp::Operator::slash;
-            else if (Tok.is(Token::KW_mod))  
-                Op =  BinaryOp::Operator::KW_mod; 
-            else if (Tok.is(Token::KW_plusEqual))  
-                Op =  BinaryOp::Operator::KW_plusEqual;   
-            else if (Tok.is(Token::KW_minusEqual))  
-                Op =  BinaryOp::Operator::KW_minusEqual;   
-            else if (Tok.is(Token::KW_starEqual))  
-                Op =  BinaryOp::Operator::KW_starEqual;   
-            else if (Tok.is(Token:: KW_slashEqual))  
-                Op =  BinaryOp::Operator::KW_slashEqual; 
-            else if (Tok.is(Token:: KW_modEq))  
-                Op =  BinaryOp::Operator::KW_modEq;   
+    Left = Context.create<Final>(Final::id, Tok.getText(),
+                                 Context.intern(Tok.getText()));
+    advance();
 
+    // id = E; or id op= E; which is the same as id = id op E;
+    Info = &getOperatorInfo(Tok.getKind());
+    if (Info->Class != Assign && Info->Class != CompoundAssign)
+    {
+        error();
+        goto _error;
     }
+    advance();
 
     E = parseExpr();
-    
-    if (expect(Token::semicolon))
+    if (!E)
         goto _error;
+    if (Info->Class == CompoundAssign)
+        E = Context.getBinaryOp(
+            static_cast<BinaryOp::Operator>(Info->Op),
+            Context.getFinal(Final::id, Left->getVal(), Left->getSymbol()), E);
 
-    return new Equation(Op,E); //MUST EDIT AST
+    if (consume(Token::semicolon))
+        goto _error;
+
+    return Context.create<Equation>(Left, E);
+_error:
+    synchronize();
+    return nullptr;
 }
 
+// arithmetic expressions: +, -, *, /, % and ^
 Expr *Parser::parseExpr()
 {
-    Expr *Left = parseTerm();
-    while (Tok.isOneOf(Token::plus, Token::minus))
-    {
-        BinaryOp::Operator Op =
-            Tok.is(Token::plus) ? BinaryOp::Plus : BinaryOp::Minus;
-        advance();
-        Expr *Right = parseTerm();
-        Left = new BinaryOp(Op, Left, Right);
-    }
-    return Left;
+    bool IsCondition;
+    return parseBinaryExpr(PrecAdditive, IsCondition);
 }
 
-Expr *Parser::parseTerm()
+// Precedence climbing over the operator table, run on explicit stacks so
+// that the nesting depth of an expression is bounded by heap memory and
+// not by the native stack. Operands and the pending operators are kept in
+// Operands and Pending; a '(' pushes a marker onto Pending and starts a
+// nested arithmetic expression, as parseExpr() would.
+//
+// All operators are left associative, so before an operator is pushed
+// every pending operator that binds at least as tight is applied first.
+// An operator looser than the minimum precedence of the innermost
+// expression ends it: the pending operators down to its '(' are applied
+// and the ')' is expected. IsCondition tells whether the result is a
+// Condition or Conditions node.
+Expr *Parser::parseBinaryExpr(unsigned MinPrec, bool &IsCondition)
 {
-    Expr *Left = parseFactor();
-    while (Tok.isOneOf(Token::star, Token::slash , Token::KW_mod))
+    struct Operand
     {
-        BinaryOp::Operator Op;
-            //Tok.is(Token::star) ? BinaryOp::star : BinaryOp::slash;
-            if (Tok.is(Token::star)) 
-                Op = BinaryOp::Operator::star;
-            else if (Tok.is(Token::slash))  
-                Op =  BinaryOp::Operator::slash;
-            else if (Tok.is(Token::KW_mod))  
-                Op =  BinaryOp::Operator::KW_mod;  
-
-
-        advance();
-        Expr *Right = parseFactor();
-        Left = new BinaryOp(Op, Left, Right);
-    }
-    return Left;
-}
+        Expr *E;
+        bool IsCondition;
+    };
+    llvm::SmallVector<Operand, 16> Operands;
+    // operators not applied yet, nullptr marks a '('
+    llvm::SmallVector<const OperatorInfo *, 16> Pending;
+    unsigned NumParens = 0;
+
+    // applies the operator on top of Pending to the two top operands
+    auto reduce = [&]() -> bool {
+        const OperatorInfo &Info = *Pending.pop_back_val();
+        Operand Right = Operands.pop_back_val();
+        Operand &Left = Operands.back();
+        switch (Info.Class)
+        {
+        case Arithmetic:
+            Left.E = Context.getBinaryOp(
+                static_cast<BinaryOp::Operator>(Info.Op), Left.E, Right.E);
+            break;
+        case Relational:
+            Left.E = Context.create<Condition>(
+                static_cast<Condition::OperatorCondition>(Info.Op), Left.E,
+                Right.E);
+            Left.IsCondition = true;
+            break;
+        case Logical:
+            // and/or join conditions only
+            if (!Left.IsCondition || !Right.IsCondition)
+            {
+                error();
+                return false;
+            }
+            Left.E = Context.create<Conditions>(
+                static_cast<Conditions::andOr>(Info.Op),
+                static_cast<Conditions *>(Left.E),
+                static_cast<Conditions *>(Right.E));
+            break;
+        default:
+            llvm_unreachable("operator without a precedence");
+        }
+        return true;
+    };
 
-Expr *Parser::parseFactor()
-{
-    Expr *Left = parseFinal();
-    while (Tok.isOneOf(Token::power))
+    IsCondition = false;
+    for (;;)
     {
-        BinaryOp::Operator Op = BinaryOp::power;
-        
-        advance();
-        Expr *Right = parseFinal();
-        Left = new BinaryOp(Op, Left, Right);
+        // an operand, possibly behind a few '('
+        while (Tok.is(Token::l_paren))
+        {
+            Pending.push_back(nullptr);
+            ++NumParens;
+            advance();
+        }
+        Expr *Final = parseFinal();
+        if (!Final)
+            return nullptr;
+        Operands.push_back(Operand{Final, false});
+
+        // then operators closing the nested expressions, if any, and
+        // the operator that takes the next operand
+        for (;;)
+        {
+            const OperatorInfo &Info = getOperatorInfo(Tok.getKind());
+            if (Info.Prec >= (NumParens ? unsigned(PrecAdditive) : MinPrec))
+            {
+                while (!Pending.empty() && Pending.back() &&
+                       Pending.back()->Prec >= Info.Prec)
+                    if (!reduce())
+                        return nullptr;
+                Pending.push_back(&Info);
+                advance();
+                break;
+            }
+
+            while (!Pending.empty() && Pending.back())
+                if (!reduce())
+                    return nullptr;
+            if (!NumParens)
+            {
+                IsCondition = Operands.back().IsCondition;
+                return Operands.back().E;
+            }
+            if (consume(Token::r_paren))
+                return nullptr;
+            Pending.pop_back();
+            --NumParens;
+        }
     }
-    return Left;
 }
 
+// a number or identifier, the operands of all operators; parentheses are
+// handled by parseBinaryExpr()
 Expr *Parser::parseFinal()
 {
     Expr *Res = nullptr;
     switch (Tok.getKind())
     {
     case Token::num:
-        Res = new Factor(Final::num, Tok.getText());
+        Res = Context.getFinal(Final::num, Tok.getText());
         advance();
         break;
     case Token::id:
-        Res = new Factor(Final::id, Tok.getText());
+        Res = Context.getFinal(Final::id, Tok.getText(),
+                               Context.intern(Tok.getText()));
         advance();
         break;
-    case Token::l_paren:
-        advance();
-        Res = parseExpr();
-        if (!consume(Token::r_paren))
-            break;
-    default: // error handling
-        if (!Res)
-            error();
-        while (!Tok.isOneOf(Token::r_paren, Token::star, Token::plus, Token::minus, Token::slash, Token::eoi))
-            advance();
+    default: // error handling, the statement recovers from it
+        error();
         break;
     }
     return Res;
@@ -269,241 +545,169 @@ Expr *Parser::parseFinal()
 //------------------------------------------------------------------------------------
 
 
+// ': begin equations end', the body of if, elif, else and loopc. A broken
+// equation is skipped up to its ';' and the rest of the body still parsed.
+// Returns false if the body had errors.
+bool Parser::parseBody(llvm::SmallVectorImpl<Expr *> &Body)
+{
+    bool Valid = true;
 
-If *Parser::parseIf() {
-
-    Conditions condits = parseConditions();
-    llvm::SmallVector<Equation *> Equations;
-    llvm::SmallVector<Elif *> Elifs;
-    ElseParse *Else;
-    if(expect(Token::KW_if))
-        goto _error;
-
-    advance();
-    
-    if(expect(Token::KW_colon))
-        goto _error;
-    
-    advance();
+    if (!Tok.is(Token::KW_colon))
+    {
+        error();
+        Valid = false;
+    }
+    else
+        advance();
 
-     if(expect(Token::KW_begin))
-        goto _error;
-    
-    advance();
+    if (consume(Token::KW_begin))
+        return false;
 
-    while(Tok.is(Token::id)){
-        Equation Eq = parseEquation();
-        Equations.push_back(E);
+    // a body opens a scope, and may hold any statement, blocks included
+    while (!Tok.isOneOf(Token::KW_end, Token::eoi))
+    {
+        Expr *Statement = parseStatement();
+        if (Statement)
+            Body.push_back(Statement);
+        else
+            Valid = false;
+    }
 
+    if (consume(Token::KW_end))
+        return false;
+    return Valid;
+}
 
-    }
 
+If *Parser::parseIf()
+{
+    Conditions *Cond;
+    llvm::SmallVector<Expr *> Body;
+    llvm::SmallVector<Elif *> Elifs;
+    Else *ElseBranch = nullptr;
+    const char *Loc;
+    bool Valid;
 
-    if(expect(Token::KW_end))
+    if (expect(Token::KW_if))
         goto _error;
-    
+    Loc = Tok.getText().data();
     advance();
 
-    while(Tok.is(Token::KW_elif)){
-        ElifParse Ef;
-        Ef = parseElif();
-        Elifs.push_back(Ef);
-
-    }
-
-    if(Tok.is(Token::KW_else))
-        Else = parseElif();
-
-
+    Cond = parseConditions();
+    Valid = Cond != nullptr;
+    if (!Valid && !skipToBody())
+        goto _error;
 
+    if (!parseBody(Body))
+        Valid = false;
 
+    while (Tok.is(Token::KW_elif))
+    {
+        Elif *Ef = parseElif();
+        if (Ef)
+            Elifs.push_back(Ef);
+        else
+            Valid = false;
+    }
 
-    return new If(condits , Equations , Elifs , Else);
+    if (Tok.is(Token::KW_else))
+    {
+        ElseBranch = parseElse();
+        if (!ElseBranch)
+            Valid = false;
+    }
 
-    
+    if (!Valid)
+        return nullptr;
+    return Context.create<If>(Cond, Body, Elifs, ElseBranch, Loc);
+_error:
+    synchronize();
+    return nullptr;
 }
 
 
 
 Elif *Parser::parseElif()
 {
-    llvm::SmallVector<Equation *> Equations;
-    Conditions condits = parseConditions();
+    Conditions *Cond;
+    llvm::SmallVector<Expr *> Body;
+    const char *Loc;
+    bool Valid;
 
-    if(expect(Token::KW_elif))
+    if (expect(Token::KW_elif))
         goto _error;
-    
+    Loc = Tok.getText().data();
     advance();
 
-    if(expect(Token::KW_colon))
+    Cond = parseConditions();
+    Valid = Cond != nullptr;
+    if (!Valid && !skipToBody())
         goto _error;
-    
-    advance();
-
-    if(expect(Token::KW_begin))
-        goto _error;
-    
-    advance();
-
-    while(Tok.is(Token::id)){
-        Equation Eq = parseEquation();
-        Equations.push_back(Eq);
-        }
-
-    if(expect(Token::KW_end))
-        goto _error;
-    
-    advance();
-
-    
-    return new ElifParse(condits , Equations);
-
 
+    if (!parseBody(Body) || !Valid)
+        return nullptr;
+    return Context.create<Elif>(Cond, Body, Loc);
+_error:
+    synchronize();
+    return nullptr;
 }
 
-Else *Parser::parseElse(){
-    llvm::SmallVector<Equation *> Equations;
-    if(expect(Token::KW_else))
-        goto _error;
-    
-    advance();
-
-    if(expect(Token::KW_colon))
-        goto _error();
-    
-    advance();
-
-
-    while(Tok.is(Token::id)){
-        Equation Eq = parseEquation();
-        Equations.push_back(Eq);
-        }
-
+Else *Parser::parseElse()
+{
+    llvm::SmallVector<Expr *> Body;
 
-    if(expect(Token::KW_end))
-        goto _error();
-    
+    if (expect(Token::KW_else))
+        goto _error;
     advance();
 
-
-
-    return new ElifParse(Equations);
-
-
+    if (!parseBody(Body))
+        return nullptr;
+    return Context.create<Else>(Body);
+_error:
+    synchronize();
+    return nullptr;
 }
 
 //------------------------------------------------------------------------------
 
 
-Conditions *Parser::parseConditions(){
-
-
-    Conditions *Left = parseCondition();
-    while (Tok.isOneOf(Token::KW_and , Token::KW_or)){
-        Conditions :: andOr AO = 
-            Tok.is(Token::KW_and) ? Conditions::KW_and  : Conditions::KW_or;
-        advance();
-        Conditions *Right = parseCondition();
-        Left = new Conditions(AO , Left , Right);  
-    }
-
-    return Left;
-
-}
-
-
-Condition *Parser::parseCondition () {
-
-    Expr *Left = parseExpr();
-    while (Tok.isOneOf(Token::KW_EqEq, Token::KW_eqNot , Token::KW_greaterEqual , Token::KW_lessEqual , Token::KW_lessThan , Token::KW_greaterThan)) {
-        
-        Condition::OperatorCondition Op;
-            if (Tok.is(Token::KW_EqEq)) 
-                Op = Condition::OperatorCondition::KW_EqEq;
-            else if (Tok.is(Token::KW_eqNot))  
-                Op= Condition::OperatorCondition::KW_eqNot;
-            else if (Tok.is(Token::KW_greaterEqual))  
-                Op= Condition::OperatorCondition::KW_greaterEqual;
-            else if (Tok.is(Token::KW_lessEqual))  
-                Op= Condition::OperatorCondition::KW_lessEqual;
-            else if (Tok.is(Token::KW_lessThan))  
-                Op= Condition::OperatorCondition::KW_lessThan;
-            else if (Tok.is(Token::KW_greaterThan))  
-                Op= Condition::OperatorCondition::KW_greaterThan;
-            else 
-                goto _error();
-
-
-
-            advance();
-            Expr *Right = parseExpr();
-            Left = new Condition(Op, Left, Right);
-
-
+// conditions joined with and/or, e.g. a < b and c != d
+Conditions *Parser::parseConditions()
+{
+    bool IsCondition;
+    Expr *E = parseBinaryExpr(PrecLogical, IsCondition);
+    if (!E)
+        return nullptr;
+    if (!IsCondition)
+    {
+        error();
+        return nullptr;
     }
-    return Left;
-
+    return static_cast<Conditions *>(E);
 }
 
 //----------------
-Loop *Parser:: parseLoop(){
-    Loop *Res = nullptr;
-    if(!Tok.is(Token::KW_loopc)){
-        goto _error();
-
-    }
-    advance();
-
-    Conditions *Conditions = parseConditions;
-    advance();
-
-    if(!Tok.is(Token::KW_colon)){
-        goto _error();
-    }
-
-    advance();
+Loop *Parser::parseLoop()
+{
+    Conditions *Cond;
+    llvm::SmallVector<Expr *> Body;
+    const char *Loc;
+    bool Valid;
 
-    if (!Tok.is(Token::KW_begin))
-    {
-        goto _error();
-    }
+    if (expect(Token::KW_loopc))
+        goto _error;
+    Loc = Tok.getText().data();
     advance();
-    llvm::SmallVector<Equation*> Equ;
-
-    while(!Tok.is(Token::id)){
-        if(Tok.is(Token::id)){
-            Equation *e;
-            e = parseEquation();
-
-            if (!Tok.is(Token::semicolon))
-            {
-                goto _error;
-            }
-            if(e)
-            {
-                Equation.push_back(e);
-            }
-            
-        }
-    }
-
-    Res = new Loop(Conditions,Equation);
-    return Res;
-}
-
 
+    Cond = parseConditions();
+    Valid = Cond != nullptr;
+    if (!Valid && !skipToBody())
+        goto _error;
 
-_error():
-   { while (Tok.getKind() != Token::eoi)
-    {
-        advance();
-    }
+    if (!parseBody(Body) || !Valid)
+        return nullptr;
+    return Context.create<Loop>(Cond, Body, Loc);
+_error:
+    synchronize();
     return nullptr;
-    }
-
-
-
-
-
-//-----------------------
-
+}
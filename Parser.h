@@ -2,24 +2,47 @@
 #define PARSER_H
 
 #include "AST.h"
+#include "ASTContext.h"
+#include "Diagnostics.h"
 #include "Lexer.h"
-#include "llvm/Support/raw_ostream.h"
+#include "TokenStream.h"
+#include <memory>
 
 class Parser
 {
-    Lexer &Lex;    // retrieve the next token from the input
-    Token Tok;     // stores the next token
-    bool HasError; // indicates if an error was detected
+    Lexer *Lex;                // retrieve the next token from the input
+    const TokenStream *Stream; // pre-lexed input, used instead of Lex if set
+    unsigned Index;            // index in Stream of the token after Tok
+    unsigned End;              // Stream is read up to here, then eoi follows
+    Token Tok;                 // stores the next token
+    bool HasError;             // indicates if an error was detected
+    unsigned NumErrors;        // syntax errors found so far
+    DiagnosticsEngine &Diags;  // where syntax errors are reported
+    std::unique_ptr<ASTContext> OwnContext; // arena owned by this parser
+    ASTContext &Context;       // arena for the nodes of the parsed tree
 
     void error()
     {
-        llvm::errs() << "Unexpected: " << Tok.getText() << "\n";
         HasError = true;
+        ++NumErrors;
+        Diags.error(Tok.getText().data(),
+                    "Unexpected: " +
+                        (Tok.is(Token::eoi) ? "end of input" : Tok.getText()));
     }
 
+    // panic-mode recovery after a syntax error, see Parser.cpp
+    void synchronize();
+    bool skipToBody();
+
     // retrieves the next token from the lexer.expect()
     // tests whether the look-ahead is of the expected kind
-    void advance() { Lex.next(Tok); }
+    void advance()
+    {
+        if (Stream)
+            Stream->get(Index < End ? Index : Stream->size() - 1, Tok), ++Index;
+        else
+            Lex->next(Tok);
+    }
 
     bool expect(Token::TokenKind Kind)
     {
@@ -40,29 +63,48 @@ class Parser
         return false;
     }
     // inja tarif kardim nonterminal
-    AST *parseNAN();
+    GSM *parseGSM();
+    void parseStatements(llvm::SmallVectorImpl<Expr *> &Statements);
     Expr *parseStatement();
-    Expr *parseDec ();
-    Expr *parseOperator ();
-    Expr *parseOperatorCondition ();
-    Expr *parseEquation ();
+    Declaration *parseDec ();
+    Equation *parseEquation ();
     Expr *parseExpr();
-    Expr *parseTerm();
-    Expr *parseFactor ();
+    Expr *parseBinaryExpr(unsigned MinPrec, bool &IsCondition);
     Expr *parseFinal ();
-    Expr *parseCondition ();
-    Expr *parseIf ();
-    Expr *parseElif ();
-    Expr *parseElse ();
-    Expr *parseC ();
-    Expr *parseLoop ();
-    Expr *parseConditions();
+    If *parseIf ();
+    Elif *parseElif ();
+    Else *parseElse ();
+    Loop *parseLoop ();
+    bool parseBody(llvm::SmallVectorImpl<Expr *> &Body);
+    Conditions *parseConditions();
     
     
 
+    // parses the tokens [Begin, End) of Stream into Context
+    Parser(const TokenStream &Stream, unsigned Begin, unsigned End,
+           ASTContext &Context, DiagnosticsEngine &Diags)
+        : Lex(nullptr), Stream(&Stream), Index(Begin), End(End),
+          HasError(false), NumErrors(0), Diags(Diags), Context(Context)
+    {
+        advance();
+    }
+
 public:
-    // initializes all members and retrieves the first token
-    Parser(Lexer &Lex) : Lex(Lex), HasError(false)
+    // initializes all members and retrieves the first token; syntax errors
+    // are reported to Diags, which also holds the error limit
+    Parser(Lexer &Lex, DiagnosticsEngine &Diags)
+        : Lex(&Lex), Stream(nullptr), Index(0), End(0), HasError(false),
+          NumErrors(0), Diags(Diags), OwnContext(new ASTContext),
+          Context(*OwnContext)
+    {
+        advance();
+    }
+
+    // parses a pre-lexed token stream instead of pulling from a lexer
+    Parser(const TokenStream &Stream, DiagnosticsEngine &Diags)
+        : Lex(nullptr), Stream(&Stream), Index(0), End(Stream.size()),
+          HasError(false), NumErrors(0), Diags(Diags),
+          OwnContext(new ASTContext), Context(*OwnContext)
     {
         advance();
     }
@@ -70,7 +112,17 @@ public:
     // get the value of error flag
     bool hasError() { return HasError; }
 
+    // number of syntax errors reported so far
+    unsigned getNumErrors() { return NumErrors; }
+
+    // the arena holding the tree; it lives as long as the parser
+    ASTContext &getContext() { return Context; }
+
     AST *parse();
+
+    // parses a pre-lexed stream with the top-level statements split across
+    // NumThreads threads; the tree is the same as the one of parse()
+    AST *parseParallel(unsigned NumThreads);
 };
 
 #endif
\ No newline at end of file
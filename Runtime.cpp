@@ -0,0 +1,24 @@
+#include "Runtime.h"
+#include <cstdio>
+
+void gsm_write(int Value)
+{
+    std::printf("%d\n", Value);
+}
+
+int gsm_pow(int Base, int Exp)
+{
+    if (Exp < 0)
+    {
+        if (Base == -1)
+            return Exp % 2 ? -1 : 1;
+        return Base == 1;
+    }
+    // square and multiply, wrapping around on overflow like the arithmetic
+    // of the generated code
+    unsigned Result = 1, Factor = Base;
+    for (; Exp; Exp >>= 1, Factor *= Factor)
+        if (Exp & 1)
+            Result *= Factor;
+    return int(Result);
+}
@@ -0,0 +1,16 @@
+#ifndef RUNTIME_H
+#define RUNTIME_H
+
+// The functions the generated code calls. Linked into gsm itself, they are
+// what the JIT resolves the calls of a program run in-process to.
+extern "C"
+{
+    // prints the value assigned to a variable
+    void gsm_write(int Value);
+
+    // Base to the power of Exp; a negative exponent gives the integer part
+    // of the reciprocal, i.e. 0 unless Base is 1 or -1
+    int gsm_pow(int Base, int Exp);
+}
+
+#endif
@@ -0,0 +1,83 @@
+#ifndef SCOPEDSYMBOLTABLE_H
+#define SCOPEDSYMBOLTABLE_H
+
+#include "llvm/ADT/SmallVector.h"
+#include <cassert>
+#include <vector>
+
+// ScopedSymbolTable maps the symbols visible at a point of the program to
+// a ValueT, with one scope per body. Symbols are the dense IDs of
+// Interner.h, so the innermost binding of every symbol is a plain vector
+// slot rather than a hash table entry.
+//
+// Declaring a symbol that is visible already shadows the outer binding:
+// the old binding is pushed onto an undo log and the slot overwritten.
+// Leaving a scope replays the log down to where the scope began, so
+// entering and leaving a scope costs one step per declaration in it, and
+// nothing is ever copied.
+template <typename ValueT> class ScopedSymbolTable {
+  struct Binding {
+    ValueT Value;
+    unsigned Depth; // scope the symbol was declared in, 0 if it is not
+  };
+
+  struct Undo {
+    unsigned Symbol;
+    Binding Old;
+  };
+
+  std::vector<Binding> Bindings;        // innermost binding, by symbol
+  std::vector<Undo> Log;                // bindings shadowed, innermost last
+  llvm::SmallVector<unsigned, 16> Scopes; // size of Log when each opened
+
+  Binding &getBinding(unsigned Symbol) {
+    if (Symbol >= Bindings.size())
+      Bindings.resize(Symbol + 1, Binding{ValueT(), 0});
+    return Bindings[Symbol];
+  }
+
+public:
+  // the outermost scope is open from the start
+  ScopedSymbolTable() { Scopes.push_back(0); }
+
+  // number of open scopes
+  unsigned getDepth() const { return Scopes.size(); }
+
+  void pushScope() { Scopes.push_back(Log.size()); }
+
+  // forgets the declarations of the innermost scope and uncovers what they
+  // shadowed
+  void popScope() {
+    assert(Scopes.size() > 1 && "the outermost scope cannot be left");
+    for (unsigned Begin = Scopes.pop_back_val(); Log.size() > Begin;) {
+      Undo &U = Log.back();
+      Bindings[U.Symbol] = U.Old;
+      Log.pop_back();
+    }
+  }
+
+  // binds Symbol to Value in the innermost scope; returns false, leaving
+  // the binding alone, if Symbol is declared in that scope already
+  bool declare(unsigned Symbol, ValueT Value) {
+    Binding &B = getBinding(Symbol);
+    if (B.Depth == getDepth())
+      return false;
+    // the outermost scope is never left
+    if (getDepth() > 1)
+      Log.push_back(Undo{Symbol, B});
+    B = Binding{Value, getDepth()};
+    return true;
+  }
+
+  bool isDeclared(unsigned Symbol) const {
+    return Symbol < Bindings.size() && Bindings[Symbol].Depth;
+  }
+
+  // the value of the innermost binding of Symbol, which must be declared
+  ValueT &lookup(unsigned Symbol) {
+    assert(isDeclared(Symbol) && "symbol is not declared");
+    return Bindings[Symbol].Value;
+  }
+};
+
+#endif
@@ -1,102 +1,100 @@
 #include "Sema.h"
-#include "llvm/ADT/StringSet.h"
-#include "llvm/Support/raw_ostream.h"
+#include "ASTWalker.h"
+#include "ScopedSymbolTable.h"
+#include "llvm/Support/Casting.h"
+#include <algorithm>
+#include <vector>
 
 namespace {
-class InputCheck : public ASTVisitor {
-  llvm::StringSet<> Scope; // StringSet to store declared variables
-  bool HasError; // Flag to indicate if an error occurred
+enum ErrorType { Twice, Not }; // Enum to represent error types: Twice - variable declared twice, Not - variable not declared
+
+// Reports an error about the variable V at Loc
+void reportError(DiagnosticsEngine &Diags, ErrorType ET, llvm::StringRef V,
+                 const char *Loc) {
+  Diags.error(Loc, "Variable " + V + " is " +
+                       (ET == Twice ? "already" : "not") + " declared");
+}
+
+// Checks if a literal divisor is zero
+bool isZero(llvm::StringRef Literal) {
+  int intval;
+  return !Literal.getAsInteger(10, intval) && intval == 0;
+}
 
-  enum ErrorType { Twice, Not }; // Enum to represent error types: Twice - variable declared twice, Not - variable not declared
+// Variables in scope, by symbol ID; Sema only needs to know that they are
+using SymbolScopes = ScopedSymbolTable<bool>;
 
-  void error(ErrorType ET, llvm::StringRef V) {
-    // Function to report errors
-    llvm::errs() << "Variable " << V << " is "
-                 << (ET == Twice ? "already" : "not")
-                 << " declared\n";
+class InputCheck : public RecursiveASTWalker<InputCheck> {
+  DiagnosticsEngine &Diags;
+  SymbolScopes Scope; // Declared variables
+  const char *Statement; // Where the statement being walked starts
+  bool HasError; // Flag to indicate if an error occurred
+
+  void error(ErrorType ET, llvm::StringRef V, const char *Loc) {
+    reportError(Diags, ET, V, Loc);
     HasError = true; // Set error flag to true
   }
 
 public:
-  InputCheck() : HasError(false) {} // Constructor
+  InputCheck(DiagnosticsEngine &Diags)
+      : Diags(Diags), Statement(nullptr), HasError(false) {} // Constructor
 
   bool hasError() { return HasError; } // Function to check if an error occurred
 
-  // Visit function for GSM nodes
-  virtual void visit(GSM &Node) override { 
-    for (auto I = Node.begin(), E = Node.end(); I != E; ++I)
-    {
-      (*I)->accept(*this); // Visit each child node
-    }
-  };
-
-  // Visit function for Factor nodes
-  virtual void visit(Final &Node) override {
-    if (Node.getKind() == Factor::Ident) {
+  // Identifiers, including assignment destinations, must be declared
+  void visitFinal(Final &Node) {
+    if (Node.getKind() == Final::id) {
       // Check if identifier is in the scope
-      if (Scope.find(Node.getVal()) == Scope.end())
-        error(Not, Node.getVal());
+      if (!Scope.isDeclared(Node.getSymbol()))
+        error(Not, Node.getVal(), Node.getLoc(Statement));
     }
-  };
-
-  // Visit function for BinaryOp nodes
-  virtual void visit(BinaryOp &Node) override {
-    if (Node.getLeft())
-      Node.getLeft()->accept(*this);
-    else
-      HasError = true;
-
-    auto right = Node.getRight();
-    if (right)
-      right->accept(*this);
-    else
-      HasError = true;
-
-    if (Node.getOperator() == BinaryOp::Operator::Div && right) {
-      Factor * f = (Factor *)right;
-
-      if (right && f->getKind() == Factor::ValueKind::Number) {
-        int intval;
-        f->getVal().getAsInteger(10, intval);
-
-        if (intval == 0) {
-          llvm::errs() << "Division by zero is not allowed." << "\n";
-          HasError = true;
-        }
-      }
-    }
-  };
-
-  // Visit function for Assignment nodes
-  virtual void visit(Equation &Node) override {
-    Factor *dest = Node.getLeft();
+  }
 
-    dest->accept(*this);
+  // Division by a literal zero
+  void visitBinaryOp(BinaryOp &Node) {
+    if (Node.getOperator() == BinaryOp::Operator::slash) {
+      Final *f = llvm::dyn_cast<Final>(Node.getRight());
 
-    if (dest->getKind() == Final::num) {
-        llvm::errs() << "Assignment destination must be an identifier.";
+      if (f && f->getKind() == Final::ValueKind::num && isZero(f->getVal())) {
+        Diags.error(f->getLoc(Statement), "Division by zero is not allowed.");
         HasError = true;
+      }
     }
+  }
 
-    if (dest->getKind() == Final::id) {
-      // Check if the identifier is in the scope
-      if (Scope.find(dest->getVal()) == Scope.end())
-        error(Not, dest->getVal());
+  void visitEquation(Equation &Node) {
+    Statement = Node.getLoc();
+    if (Node.getLeft()->getKind() == Final::num) {
+        Diags.error(Node.getLeft()->getVal().data(),
+                    "Assignment destination must be an identifier.");
+        HasError = true;
     }
+  }
 
-    if (Node.getRight())
-      Node.getRight()->accept(*this);
-  };
-
-  virtual void visit(Declaration &Node) override {
-    for (auto I = Node.begin(), E = Node.end(); I != E;
-         ++I) {
-      if (!Scope.insert(*I).second)
-        error(Twice, *I); // If the insertion fails (element already exists in Scope), report a "Twice" error
+  // The variables are declared before the initializer is walked; a
+  // variable of an enclosing scope may be declared again, it is shadowed
+  // until the end of the body
+  void visitDeclaration(Declaration &Node) {
+    Statement = Node.getLoc();
+    llvm::ArrayRef<unsigned> Syms = Node.getSymbols();
+    for (unsigned I = 0, E = Syms.size(); I != E; ++I) {
+      if (!Scope.declare(Syms[I], true))
+        error(Twice, Node.getVars()[I], Node.getVars()[I].data()); // If the insertion fails (element already exists in Scope), report a "Twice" error
     }
-    if (Node.getExpr())
-      Node.getExpr()->accept(*this); // If the Declaration node has an expression, recursively visit the expression node
-  };
+  }
+
+  // A leaf shared by hash-consing is reported at the statement using it
+  void visitIf(If &Node) { Statement = Node.getLoc(); }
+  void visitElif(Elif &Node) { Statement = Node.getLoc(); }
+  void visitLoop(Loop &Node) { Statement = Node.getLoc(); }
+
+  // Every body is a scope of its own
+  void walkBody(llvm::ArrayRef<Expr *> Body) {
+    Scope.pushScope();
+    for (Expr *Statement : Body)
+      walk(Statement);
+    Scope.popScope();
+  }
 };
 }
 
@@ -104,8 +102,66 @@ bool Sema::semantic(AST *Tree) {
   if (!Tree)
     return false; // If the input AST is not valid, return false indicating no errors
 
-  InputCheck Check; // Create an instance of the InputCheck class for semantic analysis
-  Tree->accept(Check); // Initiate the semantic analysis by traversing the AST using the accept function
+  InputCheck Check(Diags); // Create an instance of the InputCheck class for semantic analysis
+  Check.walk(Tree); // Initiate the semantic analysis by walking the AST
 
   return Check.hasError(); // Return the result of Check.hasError() indicating if any errors were detected during the analysis
 }
+
+// The flat tree is in post-order, which visits declared variables, uses and
+// operands in the same order as InputCheck, so the same checks run in a
+// plain loop over the nodes.
+// A Block comes after its statements, so its scope is opened at the first
+// node of its subtree and closed at the Block itself.
+// The flat tree keeps one text per name or literal rather than one per
+// use, so its errors have no location.
+bool Sema::semantic(const FlatAST &Tree) {
+  SymbolScopes Scope;
+  bool HasError = false;
+
+  std::vector<FlatAST::NodeRef> Opens; // first node of each Block, sorted
+  for (FlatAST::NodeRef N = 0, E = Tree.size(); N != E; ++N) {
+    if (Tree.getKind(N) != FlatAST::Block)
+      continue;
+    FlatAST::NodeRef First = N;
+    while (Tree.getNumChildren(First))
+      First = Tree.getChild(First, 0);
+    Opens.push_back(First);
+  }
+  std::sort(Opens.begin(), Opens.end());
+
+  auto NextOpen = Opens.begin();
+  for (FlatAST::NodeRef N = 0, E = Tree.size(); N != E; ++N) {
+    for (; NextOpen != Opens.end() && *NextOpen == N; ++NextOpen)
+      Scope.pushScope();
+    switch (Tree.getKind(N)) {
+    case FlatAST::Block:
+      Scope.popScope();
+      break;
+    case FlatAST::VarDecl:
+      if (!Scope.declare(Tree.getSymbol(N), true)) {
+        reportError(Diags, Twice, Tree.getText(N), nullptr);
+        HasError = true;
+      }
+      break;
+    case FlatAST::Id:
+      if (!Scope.isDeclared(Tree.getSymbol(N))) {
+        reportError(Diags, Not, Tree.getText(N), nullptr);
+        HasError = true;
+      }
+      break;
+    case FlatAST::BinaryOp: {
+      FlatAST::NodeRef Right = Tree.getChild(N, 1);
+      if (Tree.getOp(N) == BinaryOp::slash &&
+          Tree.getKind(Right) == FlatAST::Num && isZero(Tree.getText(Right))) {
+        Diags.error(nullptr, "Division by zero is not allowed.");
+        HasError = true;
+      }
+      break;
+    }
+    default:
+      break;
+    }
+  }
+  return HasError;
+}
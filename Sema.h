@@ -2,11 +2,18 @@
 #define SEMA_H
 
 #include "AST.h"
+#include "Diagnostics.h"
+#include "FlatAST.h"
 #include "Lexer.h"
 
 class Sema {
+  DiagnosticsEngine &Diags; // where semantic errors are reported
+
 public:
+  Sema(DiagnosticsEngine &Diags) : Diags(Diags) {}
+
   bool semantic(AST *Tree);
+  bool semantic(const FlatAST &Tree);
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,28 @@
+#include "TokenStream.h"
+#include "llvm/Support/ErrorHandling.h"
+
+TokenStream::TokenStream(llvm::StringRef Buffer) : Buffer(Buffer)
+{
+    if (Buffer.size() > UINT32_MAX)
+        llvm::report_fatal_error("input is too large to be pre-tokenized");
+
+    // a rough guess of one token per 4 bytes saves most of the regrowth
+    size_t Guess = Buffer.size() / 4 + 1;
+    Kinds.reserve(Guess);
+    Offsets.reserve(Guess);
+    Lengths.reserve(Guess);
+
+    Lexer Lex(Buffer);
+    Token Tok;
+    do
+    {
+        Lex.next(Tok);
+        Kinds.push_back(Tok.getKind());
+        // the end of input token has no text of its own, it sits at the end
+        llvm::StringRef Text = Tok.is(Token::eoi)
+                                   ? Buffer.drop_front(Buffer.size())
+                                   : Tok.getText();
+        Offsets.push_back(Text.data() - Buffer.data());
+        Lengths.push_back(Text.size());
+    } while (!Tok.is(Token::eoi));
+}
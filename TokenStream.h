@@ -0,0 +1,61 @@
+#ifndef TOKENSTREAM_H
+#define TOKENSTREAM_H
+
+#include "Lexer.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringRef.h"
+#include <cstdint>
+
+// TokenStream lexes a whole buffer up front and keeps the tokens as
+// parallel arrays: a 16-bit kind plus a 32-bit offset and length into the
+// buffer, 10 bytes per token instead of the 24 of a Token. Tokens are
+// addressed by index, so any lookahead costs the same; the boundary scan
+// of Parser::parseParallel reads the kinds this way.
+class TokenStream
+{
+    llvm::StringRef Buffer;                  // the lexed input
+    llvm::SmallVector<Token::TokenKind, 0> Kinds;
+    llvm::SmallVector<uint32_t, 0> Offsets;  // start of the token in Buffer
+    llvm::SmallVector<uint32_t, 0> Lengths;  // length of the token text
+
+public:
+    // lexes all of Buffer; the stream always ends with a Token::eoi
+    TokenStream(llvm::StringRef Buffer);
+
+    // number of tokens, including the final Token::eoi
+    unsigned size() const { return Kinds.size(); }
+
+    // indexes past the end refer to the final Token::eoi
+    Token::TokenKind getKind(unsigned Index) const
+    {
+        return Kinds[clamp(Index)];
+    }
+
+    llvm::StringRef getText(unsigned Index) const
+    {
+        Index = clamp(Index);
+        return Buffer.substr(Offsets[Index], Lengths[Index]);
+    }
+
+    // fills Tok with the token at Index
+    void get(unsigned Index, Token &Tok) const
+    {
+        Tok.Kind = getKind(Index);
+        Tok.Text = getText(Index);
+    }
+
+    // bytes used by the token arrays
+    size_t getMemorySize() const
+    {
+        return Kinds.capacity_in_bytes() + Offsets.capacity_in_bytes() +
+               Lengths.capacity_in_bytes();
+    }
+
+private:
+    unsigned clamp(unsigned Index) const
+    {
+        return Index < Kinds.size() ? Index : Kinds.size() - 1;
+    }
+};
+
+#endif